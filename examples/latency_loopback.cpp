@@ -0,0 +1,51 @@
+// Measures round-trip latency through a SimulatedLoopback with a known
+// delay, so the probe can be checked without any audio hardware. Exits
+// non-zero if a measurement is off by more than half a frame or has the
+// wrong polarity
+
+#include <cmath>
+#include <cstdio>
+#include <pax/latency.hpp>
+
+namespace {
+
+auto measure(const pax::latency::SimulatedLoopback::Config& config, unsigned long frames_per_buffer) -> bool
+{
+	static constexpr auto SR { 48000 };
+
+	pax::latency::SimulatedLoopback device { config };
+	pax::latency::Probe probe;
+
+	probe.configure({});
+	probe.activate();
+
+	while (!probe.done())
+	{
+		device.run([&probe](const pax::Block& block) { probe.process(block); }, frames_per_buffer, 1, SR);
+	}
+
+	const auto measurement { probe.analyze(SR) };
+
+	if (!measurement)
+	{
+		std::printf("delay %lu: nothing detected\n", config.delay);
+		return false;
+	}
+
+	std::printf("delay %lu: measured %.3f frames, confidence %.1f%s\n", config.delay, measurement->frames, measurement->confidence, measurement->inverted ? ", inverted" : "");
+
+	return std::abs(measurement->frames - double(config.delay)) < 0.5 && measurement->inverted == (config.gain < 0.0f);
+}
+
+} // namespace
+
+auto main() -> int
+{
+	auto ok { true };
+
+	ok &= measure({ .delay = 1000 }, 256);
+	ok &= measure({ .delay = 64, .channels = 1, .gain = -0.5f, .noise = 0.2f }, 64);
+	ok &= measure({ .delay = 5000, .noise = 0.05f }, 512);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "buffer.hpp"
+
+namespace pax {
+
+// Bump allocator for temporary buffers on the audio thread. Memory is
+// reserved up front and every allocation starts on a SIMD_ALIGNMENT
+// boundary. Nothing is freed individually; the stream resets the arena
+// after each process() call, so anything taken from it is only valid
+// until the processor returns.
+//
+// An allocation which doesn't fit returns nullptr and counts as an
+// overflow. The high water mark includes what overflowing allocations
+// asked for, so it says how big the arena needed to be.
+class Arena
+{
+public:
+
+	using Marker = std::size_t;
+
+	struct Stats
+	{
+		std::size_t capacity {};
+		std::size_t high_water {};
+		std::uint64_t overflows {};
+	};
+
+	Arena() = default;
+	Arena(std::size_t capacity) { reserve(capacity); }
+
+	// Control thread, while nothing is using the arena
+	auto reserve(std::size_t capacity) -> void;
+
+	// Any thread
+	auto stats() const noexcept -> Stats;
+	auto reset_stats() noexcept -> void;
+
+	// Audio thread. Memory is not initialized
+	auto allocate(std::size_t bytes) noexcept -> void*;
+	template <class T> auto allocate(std::size_t count) noexcept -> T*;
+
+	// Channel pointers for a planar buffer, e.g. for a processor to
+	// render into before mixing
+	auto planar(std::size_t channels, std::size_t frames) noexcept -> float* const*;
+
+	auto capacity() const noexcept -> std::size_t { return capacity_; }
+	auto used() const noexcept -> std::size_t { return used_; }
+
+	// For releasing everything allocated since mark() early, e.g.
+	// between nodes of a graph
+	auto mark() const noexcept -> Marker { return used_; }
+	auto rewind(Marker marker) noexcept -> void;
+	auto reset() noexcept -> void { used_ = 0; }
+
+private:
+
+	std::unique_ptr<float[], detail::AlignedDelete> memory_;
+	std::size_t capacity_ {};
+	std::size_t used_ {};
+	std::atomic<std::size_t> high_water_ {};
+	std::atomic<std::uint64_t> overflows_ {};
+};
+
+namespace detail {
+
+// Room for the given number of planar() calls
+static inline auto planar_arena_size(std::size_t buffers, std::size_t channels, std::size_t frames) -> std::size_t
+{
+	const auto pointers { align_up(channels * sizeof(float*), SIMD_ALIGNMENT) };
+	const auto samples { align_up(frames * sizeof(float), SIMD_ALIGNMENT) * channels };
+
+	return buffers * (pointers + samples);
+}
+
+} // detail
+
+inline auto Arena::reserve(std::size_t capacity) -> void
+{
+	capacity_ = detail::align_up(capacity, SIMD_ALIGNMENT);
+	used_ = 0;
+	memory_.reset();
+
+	if (capacity_ > 0)
+	{
+		memory_.reset(new (std::align_val_t { SIMD_ALIGNMENT }) float[capacity_ / sizeof(float)]);
+	}
+
+	reset_stats();
+}
+
+inline auto Arena::stats() const noexcept -> Stats
+{
+	return { capacity_, high_water_.load(std::memory_order_relaxed), overflows_.load(std::memory_order_relaxed) };
+}
+
+inline auto Arena::reset_stats() noexcept -> void
+{
+	high_water_.store(0, std::memory_order_relaxed);
+	overflows_.store(0, std::memory_order_relaxed);
+}
+
+inline auto Arena::allocate(std::size_t bytes) noexcept -> void*
+{
+	const auto size { detail::align_up(std::max(bytes, std::size_t(1)), SIMD_ALIGNMENT) };
+	const auto end { used_ + size };
+
+	// Only the audio thread writes it, so no need for a compare-exchange
+	if (end > high_water_.load(std::memory_order_relaxed))
+	{
+		high_water_.store(end, std::memory_order_relaxed);
+	}
+
+	if (end > capacity_)
+	{
+		overflows_.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	const auto out { reinterpret_cast<std::byte*>(memory_.get()) + used_ };
+
+	used_ = end;
+
+	return out;
+}
+
+template <class T>
+auto Arena::allocate(std::size_t count) noexcept -> T*
+{
+	static_assert(std::is_trivially_destructible_v<T> && alignof(T) <= SIMD_ALIGNMENT);
+
+	return static_cast<T*>(allocate(count * sizeof(T)));
+}
+
+inline auto Arena::planar(std::size_t channels, std::size_t frames) noexcept -> float* const*
+{
+	const auto marker { mark() };
+	const auto pointers { allocate<float*>(channels) };
+
+	if (!pointers) return nullptr;
+
+	for (std::size_t c { 0 }; c < channels; c++)
+	{
+		pointers[c] = allocate<float>(frames);
+
+		if (!pointers[c])
+		{
+			rewind(marker);
+			return nullptr;
+		}
+	}
+
+	return pointers;
+}
+
+inline auto Arena::rewind(Marker marker) noexcept -> void
+{
+	used_ = std::min(marker, used_);
+}
+
+} // pax
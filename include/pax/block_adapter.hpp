@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <portaudio.h>
+#include "buffer.hpp"
+#include "processor.hpp"
+
+namespace pax {
+namespace detail {
+
+static inline auto is_power_of_two(unsigned long value) -> bool
+{
+	return value > 0 && (value & (value - 1)) == 0;
+}
+
+} // detail
+
+// Re-blocks whatever PortAudio delivers into fixed-size blocks backed by
+// aligned planar buffers.
+//
+// Output frame N is the processed frame N - latency. With a fixed host
+// buffer size the latency is the minimum that always has a processed
+// block ready in time, block_size - gcd(host size, block_size), so it's
+// zero if the host size is a multiple of the block size. If the host
+// size is unspecified it's one block, which works whatever PortAudio
+// delivers.
+//
+// If the host ever delivers a size which doesn't fit, the frames which
+// can't be produced in time are output as silence and counted as an
+// underrun. That silence pushes the latency up by however much was
+// missing, for the rest of the stream, so it doesn't keep happening.
+class BlockAdapter
+{
+public:
+
+	// Called from the control thread before the stream opens. This is
+	// the only place memory is allocated
+	auto configure(unsigned long block_size, unsigned long host_frames_per_buffer, int input_channels, int output_channels, double SR) -> void;
+
+	auto block_size() const -> unsigned long { return block_size_; }
+	auto enabled() const -> bool { return block_size_ > 0; }
+	auto latency() const -> unsigned long { return latency_.load(std::memory_order_relaxed); }
+	auto underruns() const -> std::uint64_t { return underruns_.load(std::memory_order_relaxed); }
+
+	// Called from the audio thread. Splits the host block up and calls
+	// fn(const Block&) -> int once per completed fixed-size block
+	template <class Fn>
+	auto process(const Block& host, Fn&& fn) -> int;
+
+private:
+
+	auto make_block(const Block& host, unsigned long offset_end) -> Block;
+
+	unsigned long block_size_ {};
+	std::atomic<unsigned long> latency_ {};
+	double SR_ {};
+	PlanarBuffer input_;
+	PlanarBuffer output_;
+	unsigned long fill_ {};
+	std::uint64_t blocks_ {};
+	std::uint64_t sent_ {};
+	PaStreamCallbackFlags flags_ {};
+	std::atomic<std::uint64_t> underruns_ {};
+};
+
+inline auto BlockAdapter::configure(unsigned long block_size, unsigned long host_frames_per_buffer, int input_channels, int output_channels, double SR) -> void
+{
+	block_size_ = block_size;
+	SR_ = SR;
+	fill_ = 0;
+	blocks_ = 0;
+	sent_ = 0;
+	flags_ = 0;
+	underruns_ = 0;
+
+	if (block_size_ < 1)
+	{
+		latency_ = 0;
+		input_ = {};
+		output_ = {};
+		return;
+	}
+
+	if (host_frames_per_buffer == paFramesPerBufferUnspecified)
+	{
+		latency_ = block_size_;
+	}
+	else
+	{
+		latency_ = block_size_ - std::gcd(host_frames_per_buffer, block_size_);
+	}
+
+	input_ = PlanarBuffer(std::size_t(input_channels), block_size_);
+	output_ = PlanarBuffer(std::size_t(output_channels), block_size_);
+}
+
+inline auto BlockAdapter::make_block(const Block& host, unsigned long offset_end) -> Block
+{
+	// Position of the first frame of this block relative to the start of
+	// the host block, in seconds
+	const auto input_offset { (double(offset_end) - double(block_size_)) / SR_ };
+	const auto output_offset { (double(offset_end) - double(block_size_) + double(latency())) / SR_ };
+
+	Block out;
+
+	out.input = { input_.data(), input_.channels() };
+	out.output = { output_.data(), output_.channels() };
+	out.frame_count = block_size_;
+	out.time.input_adc = host.time.input_adc + input_offset;
+	out.time.current = host.time.current;
+	out.time.output_dac = host.time.output_dac + output_offset;
+	out.time.frame = blocks_ * block_size_;
+	out.flags = { flags_ };
+	out.scratch = host.scratch;
+
+	return out;
+}
+
+template <class Fn>
+auto BlockAdapter::process(const Block& host, Fn&& fn) -> int
+{
+	auto result { int(paContinue) };
+	auto latency { this->latency() };
+	unsigned long input_offset { 0 };
+	unsigned long output_offset { 0 };
+
+	flags_ |= host.flags.bits;
+
+	for (;;)
+	{
+		// Send everything which has been processed. The output buffer
+		// only holds the latest block, but with no more than a block of
+		// latency nothing older is ever needed
+		while (output_offset < host.frame_count)
+		{
+			const auto remaining { host.frame_count - output_offset };
+
+			if (sent_ < latency)
+			{
+				const auto count { std::min<std::uint64_t>(latency - sent_, remaining) };
+
+				for (std::size_t c { 0 }; c < host.output.size(); c++)
+				{
+					std::fill_n(host.output[c] + output_offset, count, 0.0f);
+				}
+
+				sent_ += count;
+				output_offset += (unsigned long)(count);
+				continue;
+			}
+
+			const auto frame { sent_ - latency };
+
+			if (frame / block_size_ + 1 != blocks_) break;
+
+			const auto start { (unsigned long)(frame % block_size_) };
+			const auto count { std::min(block_size_ - start, remaining) };
+
+			for (std::size_t c { 0 }; c < host.output.size(); c++)
+			{
+				std::copy_n(output_.channel(c) + start, count, host.output[c] + output_offset);
+			}
+
+			sent_ += count;
+			output_offset += count;
+		}
+
+		if (input_offset == host.frame_count) break;
+
+		const auto chunk { std::min(host.frame_count - input_offset, block_size_ - fill_) };
+
+		for (std::size_t c { 0 }; c < host.input.size(); c++)
+		{
+			std::copy_n(host.input[c] + input_offset, chunk, input_.channel(c) + fill_);
+		}
+
+		fill_ += chunk;
+		input_offset += chunk;
+
+		if (fill_ < block_size_) continue;
+
+		const auto block_result { fn(make_block(host, input_offset)) };
+
+		result = detail::combine_results(result, block_result);
+
+		fill_ = 0;
+		flags_ = 0;
+		blocks_++;
+	}
+
+	if (output_offset < host.frame_count)
+	{
+		const auto missing { host.frame_count - output_offset };
+
+		for (std::size_t c { 0 }; c < host.output.size(); c++)
+		{
+			std::fill_n(host.output[c] + output_offset, missing, 0.0f);
+		}
+
+		// The silence delays everything after it, so the block being
+		// collected is now on time
+		underruns_.fetch_add(1, std::memory_order_relaxed);
+		sent_ += missing;
+		latency_.store(latency + missing, std::memory_order_relaxed);
+	}
+
+	return result;
+}
+
+} // pax
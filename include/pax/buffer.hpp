@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace pax {
+
+// Wide enough for AVX-512 and a cache line
+inline constexpr std::size_t SIMD_ALIGNMENT { 64 };
+
+namespace detail {
+
+struct AlignedDelete
+{
+	auto operator()(float* ptr) const -> void
+	{
+		::operator delete[](ptr, std::align_val_t { SIMD_ALIGNMENT });
+	}
+};
+
+static inline auto align_up(std::size_t size, std::size_t alignment) -> std::size_t
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+} // detail
+
+// Planar float buffer. Every channel starts on a SIMD_ALIGNMENT boundary
+// and is padded to a whole number of alignment units. Allocation only
+// happens in the constructor
+class PlanarBuffer
+{
+public:
+
+	PlanarBuffer() = default;
+	PlanarBuffer(std::size_t channels, std::size_t frames);
+
+	auto channels() const -> std::size_t { return channels_; }
+	auto frames() const -> std::size_t { return frames_; }
+	auto data() -> float* const* { return pointers_.data(); }
+	auto data() const -> const float* const* { return pointers_.data(); }
+	auto channel(std::size_t index) -> float* { return pointers_[index]; }
+	auto channel(std::size_t index) const -> const float* { return pointers_[index]; }
+	auto clear() -> void;
+
+private:
+
+	std::size_t channels_ {};
+	std::size_t frames_ {};
+	std::size_t stride_ {};
+	std::unique_ptr<float[], detail::AlignedDelete> samples_;
+	std::vector<float*> pointers_;
+};
+
+inline PlanarBuffer::PlanarBuffer(std::size_t channels, std::size_t frames)
+	: channels_ { channels }
+	, frames_ { frames }
+	, stride_ { detail::align_up(frames, SIMD_ALIGNMENT / sizeof(float)) }
+	, pointers_(channels)
+{
+	if (channels_ * stride_ < 1) return;
+
+	samples_.reset(new (std::align_val_t { SIMD_ALIGNMENT }) float[channels_ * stride_]);
+
+	for (std::size_t c { 0 }; c < channels_; c++)
+	{
+		pointers_[c] = samples_.get() + (c * stride_);
+	}
+
+	clear();
+}
+
+inline auto PlanarBuffer::clear() -> void
+{
+	if (!samples_) return;
+
+	std::fill(samples_.get(), samples_.get() + (channels_ * stride_), 0.0f);
+}
+
+} // pax
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "processor.hpp"
+
+namespace pax {
+
+// Bounded multi-producer queue of commands for the audio thread, after
+// Dmitry Vyukov's bounded MPMC queue. Any number of control threads can
+// post without locking; posting fails rather than waits if it's full.
+//
+// Each command says when it should happen: at the start of the next
+// block, at a frame position, or at a stream time (on the output DAC
+// clock, as returned by Stream::get_time()). Bound to a processor with
+// Stream::set_processor(&processor, &queue), each block is split at the
+// exact frame every command lands on and the processor gets
+//
+//	processor.handle(const T& command)
+//
+// between the process() calls for the pieces either side.
+template <class T>
+class CommandQueue
+{
+	static_assert(std::is_nothrow_copy_assignable_v<T> && std::is_nothrow_default_constructible_v<T>);
+
+public:
+
+	enum class When
+	{
+		Now,
+		Frame,
+		Time,
+	};
+
+	struct Entry
+	{
+		T command {};
+		When when { When::Now };
+		std::uint64_t frame {};
+		PaTime time {};
+	};
+
+	// Capacity is rounded up to a power of two
+	CommandQueue(std::size_t capacity);
+
+	auto capacity() const -> std::size_t { return mask_ + 1; }
+
+	// Any thread
+	auto post(const T& command) noexcept -> bool;
+	auto post_at_frame(const T& command, std::uint64_t frame) noexcept -> bool;
+	auto post_at_time(const T& command, PaTime time) noexcept -> bool;
+
+	// Frame position the audio thread has reached, for scheduling relative
+	// to it
+	auto frame() const noexcept -> std::uint64_t { return frame_.load(std::memory_order_relaxed); }
+
+	// Posts which failed because the queue was full, and commands which
+	// arrived after the frame they were meant for and were applied late
+	auto rejected() const noexcept -> std::uint64_t { return rejected_.load(std::memory_order_relaxed); }
+	auto late() const noexcept -> std::uint64_t { return late_.load(std::memory_order_relaxed); }
+
+	// Audio thread
+	auto pop(Entry& out) noexcept -> bool;
+	auto set_frame(std::uint64_t frame) noexcept -> void { frame_.store(frame, std::memory_order_relaxed); }
+	auto count_late() noexcept -> void { late_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+
+	struct Cell
+	{
+		std::atomic<std::size_t> seq;
+		Entry entry;
+	};
+
+	auto push(const Entry& entry) noexcept -> bool;
+
+	std::size_t mask_;
+	std::unique_ptr<Cell[]> cells_;
+	alignas(64) std::atomic<std::size_t> enqueue_pos_ {};
+	alignas(64) std::atomic<std::size_t> dequeue_pos_ {};
+	alignas(64) std::atomic<std::uint64_t> frame_ {};
+	std::atomic<std::uint64_t> rejected_ {};
+	std::atomic<std::uint64_t> late_ {};
+};
+
+// Fixed set of preallocated objects for command payloads too big to copy
+// through the queue. Control threads acquire() one, fill it in and post a
+// pointer to it; the processor release()s it from handle() when it's done.
+// Both ends are lock-free and never allocate
+template <class T>
+class Pool
+{
+public:
+
+	Pool(std::size_t capacity);
+
+	// nullptr if they're all in use
+	auto acquire() noexcept -> T*;
+	auto release(T* object) noexcept -> void;
+
+private:
+
+	static constexpr std::uint32_t NONE { 0xffffffff };
+
+	std::unique_ptr<T[]> objects_;
+	std::unique_ptr<std::atomic<std::uint32_t>[]> next_;
+
+	// Index of the first free object in the low half, and a counter in the
+	// high half so a stale compare-exchange can't succeed (ABA)
+	std::atomic<std::uint64_t> head_;
+};
+
+namespace detail {
+
+// Sits between the stream and a processor, splitting each block up at the
+// commands' frame offsets
+template <class P, class T>
+class CommandBinding
+{
+public:
+
+	using Queue = CommandQueue<T>;
+
+	CommandBinding(P* processor, Queue* queue)
+		: processor_ { processor }
+		, queue_ { queue }
+	{
+	}
+
+	auto pending(const Block& block) noexcept -> bool;
+	auto prepare(const ProcessFormat& format) -> void;
+	auto process(const Block& block) -> int;
+
+private:
+
+	auto drain(const Block& block) noexcept -> void;
+	auto make_block(const Block& block, unsigned long begin, unsigned long end) noexcept -> Block;
+
+	P* processor_;
+	Queue* queue_;
+	double SR_ {};
+
+	// Sorted latest first so the next one due is at the back
+	std::vector<typename Queue::Entry> pending_;
+	std::vector<const float*> input_;
+	std::vector<float*> output_;
+};
+
+} // detail
+
+template <class T>
+CommandQueue<T>::CommandQueue(std::size_t capacity)
+	: mask_ { std::bit_ceil(std::max(capacity, std::size_t(2))) - 1 }
+	, cells_ { std::make_unique<Cell[]>(mask_ + 1) }
+{
+	for (std::size_t i { 0 }; i <= mask_; i++)
+	{
+		cells_[i].seq.store(i, std::memory_order_relaxed);
+	}
+}
+
+template <class T>
+auto CommandQueue<T>::post(const T& command) noexcept -> bool
+{
+	return push({ command, When::Now, 0, 0.0 });
+}
+
+template <class T>
+auto CommandQueue<T>::post_at_frame(const T& command, std::uint64_t frame) noexcept -> bool
+{
+	return push({ command, When::Frame, frame, 0.0 });
+}
+
+template <class T>
+auto CommandQueue<T>::post_at_time(const T& command, PaTime time) noexcept -> bool
+{
+	return push({ command, When::Time, 0, time });
+}
+
+template <class T>
+auto CommandQueue<T>::push(const Entry& entry) noexcept -> bool
+{
+	auto pos { enqueue_pos_.load(std::memory_order_relaxed) };
+
+	for (;;)
+	{
+		auto& cell { cells_[pos & mask_] };
+
+		const auto seq { cell.seq.load(std::memory_order_acquire) };
+		const auto diff { std::intptr_t(seq) - std::intptr_t(pos) };
+
+		if (diff == 0)
+		{
+			if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				cell.entry = entry;
+				cell.seq.store(pos + 1, std::memory_order_release);
+
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			rejected_.fetch_add(1, std::memory_order_relaxed);
+
+			return false;
+		}
+		else
+		{
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// Single consumer, so no compare-exchange needed on this side
+template <class T>
+auto CommandQueue<T>::pop(Entry& out) noexcept -> bool
+{
+	const auto pos { dequeue_pos_.load(std::memory_order_relaxed) };
+
+	auto& cell { cells_[pos & mask_] };
+
+	if (cell.seq.load(std::memory_order_acquire) != pos + 1) return false;
+
+	out = cell.entry;
+	cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+	dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+
+	return true;
+}
+
+template <class T>
+Pool<T>::Pool(std::size_t capacity)
+	: objects_ { std::make_unique<T[]>(capacity) }
+	, next_ { std::make_unique<std::atomic<std::uint32_t>[]>(capacity) }
+	, head_ { capacity > 0 ? 0 : NONE }
+{
+	for (std::size_t i { 0 }; i < capacity; i++)
+	{
+		next_[i].store(i + 1 < capacity ? std::uint32_t(i + 1) : NONE, std::memory_order_relaxed);
+	}
+}
+
+template <class T>
+auto Pool<T>::acquire() noexcept -> T*
+{
+	auto head { head_.load(std::memory_order_acquire) };
+
+	for (;;)
+	{
+		const auto index { std::uint32_t(head) };
+
+		if (index == NONE) return nullptr;
+
+		const auto next { std::uint64_t(next_[index].load(std::memory_order_relaxed)) };
+		const auto tag { (head >> 32) + 1 };
+
+		if (head_.compare_exchange_weak(head, (tag << 32) | next, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			return &objects_[index];
+		}
+	}
+}
+
+template <class T>
+auto Pool<T>::release(T* object) noexcept -> void
+{
+	const auto index { std::uint32_t(object - objects_.get()) };
+
+	auto head { head_.load(std::memory_order_relaxed) };
+
+	for (;;)
+	{
+		next_[index].store(std::uint32_t(head), std::memory_order_relaxed);
+
+		const auto tag { (head >> 32) + 1 };
+
+		if (head_.compare_exchange_weak(head, (tag << 32) | index, std::memory_order_release, std::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+}
+
+namespace detail {
+
+template <class P, class T>
+auto CommandBinding<P, T>::prepare(const ProcessFormat& format) -> void
+{
+	SR_ = format.SR;
+	pending_.clear();
+	pending_.reserve(queue_->capacity());
+	input_.resize(std::size_t(format.input_channels));
+	output_.resize(std::size_t(format.output_channels));
+
+	if constexpr (requires (P& p) { p.prepare(format); })
+	{
+		processor_->prepare(format);
+	}
+}
+
+// Pulls everything out of the queue, working out the frame each command
+// lands on. Anything that doesn't fit stays queued until the next block
+template <class P, class T>
+auto CommandBinding<P, T>::drain(const Block& block) noexcept -> void
+{
+	typename Queue::Entry entry;
+
+	while (pending_.size() < pending_.capacity() && queue_->pop(entry))
+	{
+		if (entry.when == Queue::When::Now)
+		{
+			entry.frame = block.time.frame;
+		}
+		else if (entry.when == Queue::When::Time)
+		{
+			const auto offset { std::llround((entry.time - block.time.output_dac) * SR_) };
+
+			entry.frame = offset < 0 ? 0 : block.time.frame + std::uint64_t(offset);
+		}
+
+		if (entry.frame < block.time.frame)
+		{
+			entry.frame = block.time.frame;
+			queue_->count_late();
+		}
+
+		// Commands for the same frame stay in the order they were posted
+		const auto pos { std::upper_bound(pending_.rbegin(), pending_.rend(), entry, [](const auto& a, const auto& b) { return a.frame < b.frame; }) };
+
+		pending_.insert(pos.base(), entry);
+	}
+}
+
+// While the processor is idle the queue keeps being drained, so it doesn't
+// fill up, and the processor wakes for the block the next command lands
+// in
+template <class P, class T>
+auto CommandBinding<P, T>::pending(const Block& block) noexcept -> bool
+{
+	drain(block);
+
+	if (!pending_.empty() && pending_.back().frame < block.time.frame + block.frame_count) return true;
+
+	if constexpr (requires (P& p) { { p.pending(block) } -> std::convertible_to<bool>; })
+	{
+		if (processor_->pending(block)) return true;
+	}
+
+	queue_->set_frame(block.time.frame + block.frame_count);
+
+	return false;
+}
+
+template <class P, class T>
+auto CommandBinding<P, T>::make_block(const Block& block, unsigned long begin, unsigned long end) noexcept -> Block
+{
+	if (begin == 0 && end == block.frame_count) return block;
+
+	for (std::size_t c { 0 }; c < block.input.size(); c++) input_[c] = block.input[c] + begin;
+	for (std::size_t c { 0 }; c < block.output.size(); c++) output_[c] = block.output[c] + begin;
+
+	const auto offset { double(begin) / SR_ };
+
+	Block out;
+
+	out.input = { input_.data(), block.input.size() };
+	out.output = { output_.data(), block.output.size() };
+	out.frame_count = end - begin;
+	out.time = block.time;
+	out.time.input_adc += offset;
+	out.time.output_dac += offset;
+	out.time.frame += begin;
+	out.scratch = block.scratch;
+
+	// Xrun flags belong to the start of the host block
+	if (begin > 0) out.flags = {};
+	else out.flags = block.flags;
+
+	return out;
+}
+
+template <class P, class T>
+auto CommandBinding<P, T>::process(const Block& block) -> int
+{
+	drain(block);
+
+	auto result { int(paContinue) };
+	unsigned long begin { 0 };
+
+	while (begin < block.frame_count)
+	{
+		while (!pending_.empty() && pending_.back().frame <= block.time.frame + begin)
+		{
+			processor_->handle(pending_.back().command);
+			pending_.pop_back();
+		}
+
+		const auto end {
+			pending_.empty()
+				? block.frame_count
+				: static_cast<unsigned long>(std::min<std::uint64_t>(block.frame_count, pending_.back().frame - block.time.frame))
+		};
+
+		// Each piece is a process() call of its own as far as the
+		// processor knows, so it gets the whole scratch arena
+		const auto marker { block.scratch ? block.scratch->mark() : 0 };
+		const auto piece_result { invoke_processor<P>(processor_, make_block(block, begin, end)) };
+
+		if (block.scratch) block.scratch->rewind(marker);
+
+		result = detail::combine_results(result, piece_result);
+
+		begin = end;
+	}
+
+	queue_->set_frame(block.time.frame + block.frame_count);
+
+	return result;
+}
+
+} // detail
+} // pax
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "buffer.hpp"
+#include "command_queue.hpp"
+#include "processor.hpp"
+#include "ring.hpp"
+
+namespace pax {
+
+// Runs coroutines on whichever thread calls run(), poll() or run_one().
+// post() is lock-free and never allocates so the audio thread can use it
+// to resume a coroutine waiting for audio
+class ManualExecutor
+{
+public:
+
+	ManualExecutor(std::size_t capacity = 64);
+
+	// Any thread. False if the queue is full
+	auto post(std::coroutine_handle<> handle) noexcept -> bool;
+
+	// Resumes everything which is ready, returning how many were resumed
+	auto poll() -> std::size_t;
+
+	// Waits for something to be ready and resumes it
+	auto run_one() -> void;
+
+	// Keeps going until stop() is called
+	auto run() -> void;
+	auto stop() noexcept -> void;
+
+private:
+
+	CommandQueue<std::coroutine_handle<>> queue_;
+	std::atomic<std::uint32_t> posted_ {};
+	std::atomic<bool> stop_ {};
+};
+
+// Minimal coroutine type to run on an executor. It starts suspended and
+// only runs once spawned, and the Task owns the coroutine frame, so it
+// must outlive it
+class Task
+{
+public:
+
+	struct promise_type
+	{
+		std::exception_ptr exception;
+
+		auto get_return_object() -> Task { return Task { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+		auto initial_suspend() noexcept -> std::suspend_always { return {}; }
+		auto final_suspend() noexcept -> std::suspend_always { return {}; }
+		auto return_void() -> void {}
+		auto unhandled_exception() -> void { exception = std::current_exception(); }
+	};
+
+	Task() = default;
+	Task(Task&& rhs) noexcept : handle_ { std::exchange(rhs.handle_, {}) } {}
+	Task(const Task&) = delete;
+	~Task() { if (handle_) handle_.destroy(); }
+
+	auto operator=(Task&& rhs) noexcept -> Task&;
+	auto operator=(const Task&) -> Task& = delete;
+
+	auto done() const -> bool { return !handle_ || handle_.done(); }
+
+	// Rethrows anything the coroutine threw
+	auto get() const -> void;
+	auto spawn(ManualExecutor& executor) -> bool;
+
+private:
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle_ { handle } {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+// What next_block() hands the coroutine. The output has to be filled in
+// before asking for the next block
+struct ChannelBlock
+{
+	std::span<const float* const> input;
+	std::span<float* const> output;
+	unsigned long frame_count {};
+	Timing time {};
+	StatusFlags flags {};
+};
+
+// Lets a coroutine process the stream's audio sequentially, as if it was
+// reading and writing a blocking stream, without a thread of its own.
+// Bind it with Stream::set_processor() and with a fixed block size
+// (Request::block_size, or a fixed frames_per_buffer).
+//
+//	while (const auto block { co_await channel.next_block() })
+//	{
+//		...
+//	}
+//
+// The coroutine gets each block slack blocks later than the callback
+// did, so that's how much it can fall behind before the output goes
+// silent and the block is counted as late. It's also how much extra
+// output latency there is. Only one coroutine can be reading at a time.
+class BlockChannel
+{
+public:
+
+	class Awaiter
+	{
+	public:
+
+		Awaiter(BlockChannel* channel) : channel_ { channel } {}
+
+		auto await_ready() noexcept -> bool { return channel_->ready(); }
+		auto await_suspend(std::coroutine_handle<> handle) noexcept -> bool { return channel_->suspend(handle); }
+		auto await_resume() noexcept -> std::optional<ChannelBlock> { return channel_->acquire(); }
+
+	private:
+
+		BlockChannel* channel_;
+	};
+
+	BlockChannel(ManualExecutor& executor, std::size_t slack = 4);
+
+	// Hands back the previous block and waits for the next one. Empty once
+	// the channel is closed
+	auto next_block() -> Awaiter;
+
+	// Wakes the reader with an empty block, e.g. when the stream is
+	// stopping. Any thread. If the executor's queue is full the wake is
+	// retried by the next block, or by calling this again
+	auto close() noexcept -> void;
+
+	// Blocks the coroutine wasn't ready in time for
+	auto late() const noexcept -> std::uint64_t { return late_.load(std::memory_order_relaxed); }
+
+	// Processor interface
+	auto prepare(const ProcessFormat& format) -> void;
+	auto process(const Block& block) noexcept -> void;
+
+private:
+
+	struct Slot
+	{
+		PlanarBuffer input;
+		PlanarBuffer output;
+		Timing time {};
+		StatusFlags flags {};
+	};
+
+	static constexpr std::uint32_t NONE { 0xffffffff };
+
+	auto acquire() noexcept -> std::optional<ChannelBlock>;
+	auto ready() noexcept -> bool;
+	auto suspend(std::coroutine_handle<> handle) noexcept -> bool;
+	auto wake() noexcept -> void;
+
+	ManualExecutor* executor_;
+	std::size_t slack_;
+	std::vector<Slot> slots_;
+	unsigned long block_size_ {};
+
+	// Slot indices. Filled input goes to the reader, filled output comes
+	// back to the audio thread
+	detail::SpscRing<std::uint32_t> to_reader_;
+	detail::SpscRing<std::uint32_t> to_audio_;
+
+	std::uint32_t current_ { NONE };
+	std::atomic<void*> waiter_ {};
+	std::atomic<bool> closed_ {};
+	std::atomic<std::uint64_t> late_ {};
+};
+
+inline ManualExecutor::ManualExecutor(std::size_t capacity)
+	: queue_ { capacity }
+{
+}
+
+inline auto ManualExecutor::post(std::coroutine_handle<> handle) noexcept -> bool
+{
+	if (!queue_.post(handle)) return false;
+
+	posted_.fetch_add(1, std::memory_order_release);
+	posted_.notify_one();
+
+	return true;
+}
+
+inline auto ManualExecutor::poll() -> std::size_t
+{
+	CommandQueue<std::coroutine_handle<>>::Entry entry;
+	std::size_t count { 0 };
+
+	while (queue_.pop(entry))
+	{
+		entry.command.resume();
+		count++;
+	}
+
+	return count;
+}
+
+inline auto ManualExecutor::run_one() -> void
+{
+	CommandQueue<std::coroutine_handle<>>::Entry entry;
+
+	for (;;)
+	{
+		// Read the counter first so a post in between can't be missed
+		const auto posted { posted_.load(std::memory_order_acquire) };
+
+		if (queue_.pop(entry))
+		{
+			entry.command.resume();
+			return;
+		}
+
+		if (stop_.load(std::memory_order_acquire)) return;
+
+		posted_.wait(posted, std::memory_order_acquire);
+	}
+}
+
+inline auto ManualExecutor::run() -> void
+{
+	while (!stop_.load(std::memory_order_acquire))
+	{
+		run_one();
+	}
+
+	stop_.store(false, std::memory_order_relaxed);
+}
+
+inline auto ManualExecutor::stop() noexcept -> void
+{
+	stop_.store(true, std::memory_order_release);
+	posted_.fetch_add(1, std::memory_order_release);
+	posted_.notify_one();
+}
+
+inline auto Task::operator=(Task&& rhs) noexcept -> Task&
+{
+	if (handle_) handle_.destroy();
+
+	handle_ = std::exchange(rhs.handle_, {});
+
+	return *this;
+}
+
+inline auto Task::get() const -> void
+{
+	if (handle_ && handle_.promise().exception)
+	{
+		std::rethrow_exception(handle_.promise().exception);
+	}
+}
+
+inline auto Task::spawn(ManualExecutor& executor) -> bool
+{
+	return handle_ && executor.post(handle_);
+}
+
+inline BlockChannel::BlockChannel(ManualExecutor& executor, std::size_t slack)
+	: executor_ { &executor }
+	, slack_ { std::max(slack, std::size_t(1)) }
+{
+}
+
+inline auto BlockChannel::next_block() -> Awaiter
+{
+	if (current_ != NONE)
+	{
+		to_audio_.write(&current_, 1);
+		current_ = NONE;
+	}
+
+	return { this };
+}
+
+inline auto BlockChannel::close() noexcept -> void
+{
+	closed_.store(true, std::memory_order_seq_cst);
+	wake();
+}
+
+// Control thread, before the stream opens. Every slot starts out queued
+// for the audio thread with silent output, which is the slack
+inline auto BlockChannel::prepare(const ProcessFormat& format) -> void
+{
+	block_size_ = format.block_size > 0 ? format.block_size : format.frames_per_buffer;
+
+	if (block_size_ < 1)
+	{
+		throw std::runtime_error("BlockChannel needs a fixed block size");
+	}
+
+	slots_.clear();
+	slots_.reserve(slack_);
+
+	for (std::size_t i { 0 }; i < slack_; i++)
+	{
+		slots_.push_back({ { std::size_t(format.input_channels), block_size_ }, { std::size_t(format.output_channels), block_size_ } });
+	}
+
+	to_reader_.reset(slack_);
+	to_audio_.reset(slack_);
+
+	for (std::uint32_t i { 0 }; i < slack_; i++)
+	{
+		to_audio_.write(&i, 1);
+	}
+
+	current_ = NONE;
+	closed_.store(false, std::memory_order_relaxed);
+	late_.store(0, std::memory_order_relaxed);
+}
+
+// The slot the reader just finished goes out, then takes this block's
+// input back to the reader
+inline auto BlockChannel::process(const Block& block) noexcept -> void
+{
+	std::uint32_t index;
+
+	const auto frames { std::min<std::size_t>(block.frame_count, block_size_) };
+
+	if (to_audio_.read(&index, 1) < 1)
+	{
+		for (const auto channel : block.output)
+		{
+			std::fill(channel, channel + block.frame_count, 0.0f);
+		}
+
+		late_.fetch_add(1, std::memory_order_relaxed);
+
+		return;
+	}
+
+	auto& slot { slots_[index] };
+
+	for (std::size_t c { 0 }; c < block.output.size(); c++)
+	{
+		std::copy(slot.output.channel(c), slot.output.channel(c) + frames, block.output[c]);
+	}
+
+	for (std::size_t c { 0 }; c < block.input.size(); c++)
+	{
+		std::copy(block.input[c], block.input[c] + frames, slot.input.channel(c));
+	}
+
+	slot.time = block.time;
+	slot.flags = block.flags;
+
+	to_reader_.write(&index, 1);
+	wake();
+}
+
+inline auto BlockChannel::acquire() noexcept -> std::optional<ChannelBlock>
+{
+	if (closed_.load(std::memory_order_acquire)) return std::nullopt;
+	if (to_reader_.read(&current_, 1) < 1) return std::nullopt;
+
+	auto& slot { slots_[current_] };
+
+	ChannelBlock out;
+
+	out.input = { slot.input.data(), slot.input.channels() };
+	out.output = { slot.output.data(), slot.output.channels() };
+	out.frame_count = block_size_;
+	out.time = slot.time;
+	out.flags = slot.flags;
+
+	return out;
+}
+
+inline auto BlockChannel::ready() noexcept -> bool
+{
+	return to_reader_.read_available() > 0 || closed_.load(std::memory_order_acquire);
+}
+
+// The audio thread might deliver a block between ready() and publishing
+// the waiter, so check again afterwards. Whichever side takes the waiter
+// back out is the one which resumes it
+inline auto BlockChannel::suspend(std::coroutine_handle<> handle) noexcept -> bool
+{
+	waiter_.store(handle.address(), std::memory_order_seq_cst);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (!ready()) return true;
+
+	return waiter_.exchange(nullptr, std::memory_order_seq_cst) != handle.address();
+}
+
+inline auto BlockChannel::wake() noexcept -> void
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (waiter_.load(std::memory_order_seq_cst) == nullptr) return;
+
+	if (const auto waiter { waiter_.exchange(nullptr, std::memory_order_seq_cst) })
+	{
+		if (executor_->post(std::coroutine_handle<>::from_address(waiter))) return;
+
+		// The executor's queue is full. Park the reader again so the next
+		// block (or close()) tries again, rather than losing it
+		waiter_.store(waiter, std::memory_order_seq_cst);
+	}
+}
+
+} // pax
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string>
 #include <string_view>
 #include "pa_lib.hpp"
 
@@ -23,6 +24,10 @@ public:
 	const std::string_view name;
 
 	Device(PaDeviceIndex device_index);
+
+	// Host API and device name. Unlike the index, this stays the same
+	// across rescans and restarts
+	auto identity() const -> std::string;
 };
 
 namespace detail {
@@ -53,4 +58,16 @@ inline Device::Device(PaDeviceIndex index_)
 {
 }
 
+inline auto Device::identity() const -> std::string
+{
+	const auto host_info { portaudio::Library::C::NoThrow::GetHostApiInfo(info.hostApi) };
+
+	std::string out { host_info ? host_info.value->name : "" };
+
+	out += '/';
+	out += name;
+
+	return out;
+}
+
 } // pax
@@ -0,0 +1,504 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <numbers>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "processor.hpp"
+
+namespace pax {
+namespace latency {
+
+// Round-trip latency measurement. A maximum length sequence is played
+// out of one output channel and recorded on a looped-back input channel,
+// and the delay is found by cross-correlating the two. This measures
+// what the driver actually does rather than what it claims.
+
+struct Options
+{
+	// Sequence length is 2^order - 1 frames. It has to be longer than the
+	// round trip, so the default (32767) is good for ~0.68 s at 48 kHz
+	int order { 15 };
+
+	// Number of sequence periods to play. The first and last are only
+	// there so every period in between is captured whole
+	int periods { 5 };
+
+	float level { 0.25f };
+	int input_channel { 0 };
+	int output_channel { 0 };
+
+	// Peak to RMS ratio of the correlation below which we assume there is
+	// no loopback
+	double min_confidence { 10.0 };
+};
+
+struct Measurement
+{
+	// Input frame index minus output frame index of the same sample, as
+	// seen from the callback
+	double frames {};
+	double seconds {};
+
+	// Standard deviation across periods
+	double jitter_seconds {};
+
+	// What the driver reported (input + output latency)
+	double reported_seconds {};
+
+	double confidence {};
+	bool inverted {};
+	int SR {};
+};
+
+namespace detail {
+
+static inline auto generate_mls(int order) -> std::vector<float>
+{
+	// Feedback taps giving a maximal period for a right-shifting LFSR
+	// with the new bit inserted at the top
+	static constexpr std::uint32_t TAPS[] =
+	{
+		(1u << 0) | (1u << 3),                                // 10
+		(1u << 0) | (1u << 2),                                // 11
+		(1u << 0) | (1u << 1) | (1u << 2) | (1u << 8),        // 12
+		(1u << 0) | (1u << 1) | (1u << 2) | (1u << 5),        // 13
+		(1u << 0) | (1u << 1) | (1u << 2) | (1u << 12),       // 14
+		(1u << 0) | (1u << 1),                                // 15
+		(1u << 0) | (1u << 1) | (1u << 3) | (1u << 12),       // 16
+		(1u << 0) | (1u << 3),                                // 17
+		(1u << 0) | (1u << 7),                                // 18
+		(1u << 0) | (1u << 1) | (1u << 2) | (1u << 5),        // 19
+		(1u << 0) | (1u << 3),                                // 20
+	};
+
+	order = std::clamp(order, 10, 20);
+
+	const auto taps { TAPS[order - 10] };
+	const auto length { (std::size_t(1) << order) - 1 };
+
+	std::vector<float> out(length);
+	std::uint32_t state { 1 };
+
+	for (std::size_t i { 0 }; i < length; i++)
+	{
+		const auto bit { std::uint32_t(std::popcount(state & taps) & 1) };
+
+		out[i] = (state & 1) ? 1.0f : -1.0f;
+		state = (state >> 1) | (bit << (order - 1));
+	}
+
+	return out;
+}
+
+// In-place iterative radix-2 FFT. data.size() must be a power of two
+static inline auto fft(std::vector<std::complex<double>>& data, bool inverse) -> void
+{
+	const auto n { data.size() };
+
+	for (std::size_t i { 1 }, j { 0 }; i < n; i++)
+	{
+		auto bit { n >> 1 };
+
+		for (; j & bit; bit >>= 1) j ^= bit;
+
+		j ^= bit;
+
+		if (i < j) std::swap(data[i], data[j]);
+	}
+
+	for (std::size_t size { 2 }; size <= n; size <<= 1)
+	{
+		const auto angle { (inverse ? 2.0 : -2.0) * std::numbers::pi / double(size) };
+		const std::complex<double> step { std::cos(angle), std::sin(angle) };
+
+		for (std::size_t start { 0 }; start < n; start += size)
+		{
+			std::complex<double> w { 1.0 };
+
+			for (std::size_t k { 0 }; k < size / 2; k++)
+			{
+				const auto a { data[start + k] };
+				const auto b { data[start + k + size / 2] * w };
+
+				data[start + k] = a + b;
+				data[start + k + size / 2] = a - b;
+				w *= step;
+			}
+		}
+	}
+
+	if (!inverse) return;
+
+	for (auto& value : data) value /= double(n);
+}
+
+// c[m] = sum over n of signal[n + m] * reference[n], for every m where
+// the reference fits entirely inside the signal
+static inline auto cross_correlate(const std::vector<float>& signal, const std::vector<float>& reference) -> std::vector<double>
+{
+	std::size_t size { 1 };
+
+	while (size < signal.size() + reference.size()) size <<= 1;
+
+	std::vector<std::complex<double>> a(size), b(size);
+
+	std::copy(signal.begin(), signal.end(), a.begin());
+	std::copy(reference.begin(), reference.end(), b.begin());
+
+	fft(a, false);
+	fft(b, false);
+
+	for (std::size_t i { 0 }; i < size; i++)
+	{
+		a[i] *= std::conj(b[i]);
+	}
+
+	fft(a, true);
+
+	std::vector<double> out(signal.size() - reference.size() + 1);
+
+	for (std::size_t m { 0 }; m < out.size(); m++)
+	{
+		out[m] = a[m].real();
+	}
+
+	return out;
+}
+
+} // detail
+
+// The realtime half runs inside the audio callback and only touches
+// buffers allocated by configure(). analyze() runs afterwards on the
+// control thread
+class Probe
+{
+public:
+
+	auto configure(const Options& options) -> void;
+
+	// Audio thread. Plays the sequence and records the input until the
+	// capture is full, then deactivates itself
+	auto process(const Block& block) -> void;
+
+	auto activate() -> void { done_.store(false, std::memory_order_relaxed); active_.store(true, std::memory_order_release); }
+	auto deactivate() -> void { active_.store(false, std::memory_order_seq_cst); }
+	auto active() const -> bool { return active_.load(std::memory_order_acquire); }
+	auto done() const -> bool { return done_.load(std::memory_order_acquire); }
+
+	auto analyze(int SR) const -> std::optional<Measurement>;
+
+private:
+
+	Options options_;
+	std::vector<float> sequence_;
+	std::vector<float> capture_;
+	std::size_t position_ {};
+	std::atomic<bool> active_ {};
+	std::atomic<bool> done_ {};
+};
+
+inline auto Probe::configure(const Options& options) -> void
+{
+	options_ = options;
+	options_.periods = std::max(options_.periods, 3);
+	sequence_ = detail::generate_mls(options_.order);
+	capture_.assign(sequence_.size() * std::size_t(options_.periods), 0.0f);
+	position_ = 0;
+	done_ = false;
+	active_ = false;
+}
+
+inline auto Probe::process(const Block& block) -> void
+{
+	const auto length { sequence_.size() };
+	const auto remaining { capture_.size() - position_ };
+	const auto frames { std::min(std::size_t(block.frame_count), remaining) };
+
+	for (const auto channel : block.output)
+	{
+		std::fill_n(channel, block.frame_count, 0.0f);
+	}
+
+	if (std::size_t(options_.output_channel) < block.output.size())
+	{
+		const auto out { block.output[options_.output_channel] };
+
+		for (std::size_t i { 0 }; i < frames; i++)
+		{
+			out[i] = sequence_[(position_ + i) % length] * options_.level;
+		}
+	}
+
+	if (std::size_t(options_.input_channel) < block.input.size())
+	{
+		std::copy_n(block.input[options_.input_channel], frames, capture_.begin() + std::ptrdiff_t(position_));
+	}
+
+	position_ += frames;
+
+	if (position_ < capture_.size()) return;
+
+	active_.store(false, std::memory_order_relaxed);
+	done_.store(true, std::memory_order_release);
+}
+
+inline auto Probe::analyze(int SR) const -> std::optional<Measurement>
+{
+	if (!done() || SR < 1) return std::nullopt;
+
+	const auto length { sequence_.size() };
+	const auto correlation { detail::cross_correlate(capture_, sequence_) };
+
+	std::vector<double> delays;
+	double confidence { 0.0 };
+	auto inverted_votes { 0 };
+
+	// The first period is skipped so we only look at steady state, and
+	// each window [kL, (k+1)L) contains exactly one peak at kL + delay
+	for (std::size_t k { 1 }; (k + 1) * length <= correlation.size(); k++)
+	{
+		const auto begin { k * length };
+
+		std::size_t peak { begin };
+		double sum_squares { 0.0 };
+
+		for (std::size_t m { begin }; m < begin + length; m++)
+		{
+			sum_squares += correlation[m] * correlation[m];
+
+			if (std::abs(correlation[m]) > std::abs(correlation[peak])) peak = m;
+		}
+
+		const auto rms { std::sqrt(sum_squares / double(length)) };
+		const auto peak_value { std::abs(correlation[peak]) };
+
+		confidence = std::max(confidence, rms > 0.0 ? peak_value / rms : 0.0);
+
+		if (correlation[peak] < 0.0) inverted_votes++;
+
+		// Parabolic interpolation for a sub-frame estimate
+		auto offset { 0.0 };
+
+		if (peak > begin && peak + 1 < begin + length)
+		{
+			const auto a { std::abs(correlation[peak - 1]) };
+			const auto b { peak_value };
+			const auto c { std::abs(correlation[peak + 1]) };
+			const auto denominator { a - (2.0 * b) + c };
+
+			if (denominator != 0.0) offset = 0.5 * (a - c) / denominator;
+		}
+
+		delays.push_back(double(peak - begin) + offset);
+	}
+
+	if (delays.empty() || confidence < options_.min_confidence) return std::nullopt;
+
+	auto mean { 0.0 };
+
+	for (const auto delay : delays) mean += delay;
+
+	mean /= double(delays.size());
+
+	auto variance { 0.0 };
+
+	for (const auto delay : delays) variance += (delay - mean) * (delay - mean);
+
+	variance /= double(delays.size());
+
+	Measurement out;
+
+	out.frames = mean;
+	out.seconds = mean / double(SR);
+	out.jitter_seconds = std::sqrt(variance) / double(SR);
+	out.confidence = confidence;
+	out.inverted = inverted_votes * 2 > int(delays.size());
+	out.SR = SR;
+
+	return out;
+}
+
+// Measurements keyed by device identity (see Device::identity()), so a
+// measurement made once can be applied whenever that device pair is used
+// again. save() and load() use a simple line-based text format
+class Store
+{
+public:
+
+	static auto key(const std::string& input_identity, const std::string& output_identity) -> std::string;
+
+	auto get(const std::string& key) const -> std::optional<Measurement>;
+	auto set(const std::string& key, const Measurement& measurement) -> void;
+	auto load(std::istream& is) -> void;
+	auto save(std::ostream& os) const -> void;
+
+private:
+
+	std::map<std::string, Measurement> measurements_;
+};
+
+inline auto Store::key(const std::string& input_identity, const std::string& output_identity) -> std::string
+{
+	return input_identity + " -> " + output_identity;
+}
+
+inline auto Store::get(const std::string& key) const -> std::optional<Measurement>
+{
+	const auto pos { measurements_.find(key) };
+
+	if (pos == measurements_.end()) return std::nullopt;
+
+	return pos->second;
+}
+
+inline auto Store::set(const std::string& key, const Measurement& measurement) -> void
+{
+	measurements_[key] = measurement;
+}
+
+inline auto Store::load(std::istream& is) -> void
+{
+	std::string key;
+
+	while (std::getline(is, key))
+	{
+		if (key.empty()) continue;
+
+		Measurement measurement;
+
+		if (!(is >> measurement.frames >> measurement.seconds >> measurement.jitter_seconds >> measurement.reported_seconds >> measurement.confidence >> measurement.inverted >> measurement.SR)) break;
+
+		is.ignore(1);
+		measurements_[key] = measurement;
+	}
+}
+
+inline auto Store::save(std::ostream& os) const -> void
+{
+	const auto precision { os.precision(17) };
+
+	for (const auto& [key, measurement] : measurements_)
+	{
+		os << key << "\n"
+		   << measurement.frames << " " << measurement.seconds << " " << measurement.jitter_seconds << " "
+		   << measurement.reported_seconds << " " << measurement.confidence << " " << measurement.inverted << " "
+		   << measurement.SR << "\n";
+	}
+
+	os.precision(precision);
+}
+
+// Offline stand-in for a device with its output wired to its input, so
+// the probe (or anything else) can be exercised without PortAudio. Output
+// channel N is fed back to input channel N after delay frames, with
+// optional gain (negative to flip polarity) and white noise. As with a
+// real device the delay can't be shorter than one buffer
+class SimulatedLoopback
+{
+public:
+
+	struct Config
+	{
+		unsigned long delay {};
+		int channels { 2 };
+		float gain { 1.0f };
+		float noise { 0.0f };
+		unsigned int seed { 1 };
+	};
+
+	SimulatedLoopback(const Config& config);
+
+	// Calls fn(const Block&) blocks times with frames_per_buffer frames.
+	// frames_per_buffer must not be greater than the delay
+	template <class Fn>
+	auto run(Fn&& fn, unsigned long frames_per_buffer, std::size_t blocks, double SR) -> void;
+
+private:
+
+	Config config_;
+	std::vector<std::vector<float>> lines_;
+	std::size_t position_ {};
+	std::minstd_rand random_;
+};
+
+inline SimulatedLoopback::SimulatedLoopback(const Config& config)
+	: config_ { config }
+	, lines_(std::size_t(config.channels), std::vector<float>(config.delay + 1, 0.0f))
+	, random_ { config.seed }
+{
+}
+
+template <class Fn>
+auto SimulatedLoopback::run(Fn&& fn, unsigned long frames_per_buffer, std::size_t blocks, double SR) -> void
+{
+	const auto channels { std::size_t(config_.channels) };
+
+	std::vector<std::vector<float>> input(channels, std::vector<float>(frames_per_buffer));
+	std::vector<std::vector<float>> output(channels, std::vector<float>(frames_per_buffer));
+	std::vector<const float*> input_ptrs(channels);
+	std::vector<float*> output_ptrs(channels);
+	std::uniform_real_distribution<float> noise { -config_.noise, config_.noise };
+
+	for (std::size_t c { 0 }; c < channels; c++)
+	{
+		input_ptrs[c] = input[c].data();
+		output_ptrs[c] = output[c].data();
+	}
+
+	const auto line_length { std::size_t(config_.delay) + 1 };
+
+	assert(frames_per_buffer <= config_.delay);
+
+	for (std::size_t b { 0 }; b < blocks; b++)
+	{
+		const auto start { position_ };
+
+		// The input for frame N is whatever was output at N - delay
+		for (std::size_t c { 0 }; c < channels; c++)
+		{
+			for (unsigned long i { 0 }; i < frames_per_buffer; i++)
+			{
+				const auto read { (start + i + line_length - config_.delay) % line_length };
+
+				input[c][i] = (lines_[c][read] * config_.gain) + noise(random_);
+			}
+		}
+
+		Block block;
+
+		block.input = { input_ptrs.data(), channels };
+		block.output = { output_ptrs.data(), channels };
+		block.frame_count = frames_per_buffer;
+		block.time.frame = position_;
+		block.time.current = double(position_) / SR;
+		block.time.input_adc = block.time.current;
+		block.time.output_dac = block.time.current;
+
+		fn(block);
+
+		for (std::size_t c { 0 }; c < channels; c++)
+		{
+			for (unsigned long i { 0 }; i < frames_per_buffer; i++)
+			{
+				lines_[c][(start + i) % line_length] = output[c][i];
+			}
+		}
+
+		position_ += frames_per_buffer;
+	}
+}
+
+} // latency
+} // pax
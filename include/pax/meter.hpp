@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <numbers>
+#include <vector>
+#include "seqlock.hpp"
+#include "simd.hpp"
+
+namespace pax {
+
+// Linear amplitudes
+struct Levels
+{
+	// Instant rise, exponential release
+	float peak {};
+	float true_peak {};
+
+	// Exponentially weighted over the RMS window
+	float rms {};
+
+	// Highest peak and true peak since the last reset_max()
+	float max_peak {};
+	float max_true_peak {};
+};
+
+// Per-channel peak, RMS and 4x oversampled true-peak metering for the
+// audio thread. Each channel's levels are published through their own
+// SeqLock, so any number of UI threads can poll them at any rate without
+// the audio thread ever waiting.
+//
+// Ballistics are applied on the audio thread, so a slow reader still sees
+// the peaks it missed decaying rather than missing them altogether.
+class Meter
+{
+public:
+
+	struct Options
+	{
+		bool true_peak { true };
+		double release_seconds { 1.5 };
+		double rms_window_seconds { 0.3 };
+	};
+
+	// Control thread, while nothing is calling process(). Readers can
+	// keep polling while this happens
+	auto configure(const Options& options, int channels, double SR) -> void;
+	auto channels() const -> int;
+
+	// Audio thread
+	auto process(const float* const* data, std::size_t channels, unsigned long frame_count) noexcept -> void;
+
+	// Any thread
+	auto get(int channel) const -> Levels;
+	auto reset_max() -> void { reset_requests_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+
+	// 4 phases of 12 taps, the same size as the ITU-R BS.1770 interpolator
+	static constexpr std::size_t TAPS { 12 };
+	static constexpr std::size_t CHUNK { 256 };
+
+	struct Channel
+	{
+		Levels levels;
+		float mean_square {};
+		std::vector<float> history;
+	};
+
+	// Readers use this through a plain pointer, so it's never freed while
+	// the meter exists. It's reused unless the channel count grows, so
+	// only a handful are ever retired
+	struct Published
+	{
+		std::atomic<int> channels {};
+		std::size_t capacity {};
+		std::unique_ptr<SeqLock<Levels>[]> levels;
+	};
+
+	auto true_peak(Channel& channel, const float* data, unsigned long frame_count) noexcept -> float;
+
+	Options options_;
+	int channels_ {};
+	double SR_ {};
+	std::vector<float> coefficients_;
+	std::vector<Channel> state_;
+	std::vector<std::unique_ptr<Published>> retired_;
+	std::atomic<Published*> published_ {};
+	SeqLock<Levels>* publish_to_ {};
+	std::atomic<std::uint32_t> reset_requests_ {};
+	std::uint32_t resets_handled_ {};
+	unsigned long coefficient_frames_ {};
+	float release_ {};
+	float rms_weight_ {};
+};
+
+namespace detail {
+
+// Windowed sinc lowpass at the original Nyquist. Upsampled output 4n + p
+// is the sum over t of h[4t + p] * x[n - t], so h as it is has the
+// tap-major layout simd::peak_4x wants
+static inline auto make_true_peak_filter(std::size_t taps) -> std::vector<float>
+{
+	constexpr auto pi { std::numbers::pi };
+
+	const auto length { taps * 4 };
+	const auto center { double(length - 1) / 2.0 };
+
+	std::vector<float> out(length);
+
+	for (std::size_t k { 0 }; k < length; k++)
+	{
+		const auto x { (double(k) - center) / 4.0 };
+		const auto sinc { x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x) };
+		const auto w { double(k) / double(length - 1) };
+		const auto blackman { 0.42 - (0.5 * std::cos(2.0 * pi * w)) + (0.08 * std::cos(4.0 * pi * w)) };
+
+		// Phase p of tap t is h[t * 4 + p], which is already tap-major
+		out[k] = float(sinc * blackman);
+	}
+
+	return out;
+}
+
+} // detail
+
+inline auto Meter::configure(const Options& options, int channels, double SR) -> void
+{
+	options_ = options;
+	channels_ = std::max(channels, 0);
+	SR_ = SR;
+	coefficients_ = detail::make_true_peak_filter(TAPS);
+	state_.assign(std::size_t(channels_), {});
+
+	auto published { published_.load(std::memory_order_acquire) };
+
+	if (!published || published->capacity < std::size_t(channels_))
+	{
+		auto replacement { std::make_unique<Published>() };
+
+		replacement->capacity = std::size_t(channels_);
+		replacement->levels = std::make_unique<SeqLock<Levels>[]>(replacement->capacity);
+		published = replacement.get();
+		retired_.push_back(std::move(replacement));
+	}
+
+	for (std::size_t c { 0 }; c < std::size_t(channels_); c++)
+	{
+		published->levels[c].store({});
+	}
+
+	published->channels.store(channels_, std::memory_order_release);
+	publish_to_ = published->levels.get();
+	published_.store(published, std::memory_order_release);
+
+	coefficient_frames_ = 0;
+	resets_handled_ = reset_requests_.load(std::memory_order_relaxed);
+
+	for (auto& channel : state_)
+	{
+		channel.history.assign(TAPS - 1 + CHUNK, 0.0f);
+	}
+}
+
+inline auto Meter::channels() const -> int
+{
+	const auto published { published_.load(std::memory_order_acquire) };
+
+	return published ? published->channels.load(std::memory_order_acquire) : 0;
+}
+
+inline auto Meter::get(int channel) const -> Levels
+{
+	const auto published { published_.load(std::memory_order_acquire) };
+
+	if (!published || channel < 0 || channel >= published->channels.load(std::memory_order_acquire)) return {};
+
+	return published->levels[std::size_t(channel)].load();
+}
+
+// The history buffer holds the previous TAPS - 1 samples followed by up
+// to CHUNK new ones, so the filter always sees contiguous input
+inline auto Meter::true_peak(Channel& channel, const float* data, unsigned long frame_count) noexcept -> float
+{
+	float out { 0.0f };
+
+	const auto buffer { channel.history.data() };
+
+	for (unsigned long offset { 0 }; offset < frame_count; offset += CHUNK)
+	{
+		const auto count { std::min<std::size_t>(CHUNK, frame_count - offset) };
+
+		std::copy_n(data + offset, count, buffer + TAPS - 1);
+
+		out = std::max(out, simd::peak_4x(buffer + TAPS - 1, count, coefficients_.data(), TAPS));
+
+		std::copy_n(buffer + count, TAPS - 1, buffer);
+	}
+
+	return out;
+}
+
+inline auto Meter::process(const float* const* data, std::size_t channels, unsigned long frame_count) noexcept -> void
+{
+	if (frame_count < 1 || !data) return;
+
+	// Only recalculated when the block size changes
+	if (frame_count != coefficient_frames_)
+	{
+		coefficient_frames_ = frame_count;
+		release_ = float(std::exp(-double(frame_count) / (std::max(options_.release_seconds, 0.001) * SR_)));
+		rms_weight_ = 1.0f - float(std::exp(-double(frame_count) / (std::max(options_.rms_window_seconds, 0.001) * SR_)));
+	}
+
+	const auto resets { reset_requests_.load(std::memory_order_relaxed) };
+	const auto reset { resets != resets_handled_ };
+
+	resets_handled_ = resets;
+
+	for (std::size_t c { 0 }; c < std::min(channels, state_.size()); c++)
+	{
+		auto& channel { state_[c] };
+		auto& levels { channel.levels };
+
+		const auto samples { data[c] };
+		const auto peak { simd::peak(samples, frame_count) };
+		const auto mean_square { simd::sum_of_squares(samples, frame_count) / float(frame_count) };
+
+		channel.mean_square += (mean_square - channel.mean_square) * rms_weight_;
+
+		levels.peak = std::max(peak, levels.peak * release_);
+		levels.rms = std::sqrt(channel.mean_square);
+
+		if (reset)
+		{
+			levels.max_peak = 0.0f;
+			levels.max_true_peak = 0.0f;
+		}
+
+		levels.max_peak = std::max(levels.max_peak, peak);
+
+		if (options_.true_peak)
+		{
+			// None of the phases land exactly on the original samples so
+			// the sample peak is included too
+			const auto true_peak { std::max(peak, this->true_peak(channel, samples, frame_count)) };
+
+			levels.true_peak = std::max(true_peak, levels.true_peak * release_);
+			levels.max_true_peak = std::max(levels.max_true_peak, true_peak);
+		}
+
+		publish_to_[c].store(levels);
+	}
+}
+
+} // pax
@@ -0,0 +1,474 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "buffer.hpp"
+#include "processor.hpp"
+#include "rt.hpp"
+#include "simd.hpp"
+
+namespace pax {
+
+// Runs several independent processors (an engine, a preview player, a
+// metronome...) and sums their output, each with its own gain. Bind it
+// with Stream::set_processor(). Every client sees the same input.
+//
+// Clients can be added and removed from the control thread while the
+// stream runs, without the audio thread ever taking a lock. A new client
+// fades in over its first block and gain changes are ramped over a block.
+// A client returning paComplete or paAbort is finished: it stops being
+// run, but stays registered until it's removed. When every client returns
+// process_idle (or there are none) the mixer does too, so wake the stream
+// after adding a client to an idle mixer.
+//
+// With worker_threads > 0 the clients are spread over that many extra
+// threads plus the audio thread. The audio thread waits for the workers
+// to finish each block, so only use this when clients are heavy enough
+// to be worth it, and give the workers a realtime priority.
+class Mixer
+{
+public:
+
+	using ClientId = int;
+
+	struct Config
+	{
+		std::size_t max_clients { 16 };
+		int worker_threads {};
+
+		// SCHED_FIFO priority for the workers, 0 to leave them alone
+		int worker_priority {};
+
+		// Block size for rendering clients when the host's buffer size
+		// isn't fixed. Longer callbacks are rendered in pieces
+		unsigned long max_frames { 4096 };
+	};
+
+	// Load is the time spent in the client's process() as a fraction of
+	// the block's duration, smoothed over a few blocks
+	struct ClientStats
+	{
+		double load {};
+		double peak_load {};
+		std::uint64_t blocks {};
+		bool finished {};
+	};
+
+	Mixer() : Mixer { Config {} } {}
+	Mixer(Config config);
+	~Mixer();
+
+	Mixer(const Mixer&) = delete;
+	auto operator=(const Mixer&) -> Mixer& = delete;
+
+	// Control thread. Returns -1 if every slot is taken. If the mixer has
+	// already been prepared the client is prepared here, which can throw
+	template <class T> auto add(T* processor, float gain = 1.0f) -> ClientId;
+	auto add(Processor processor, float gain = 1.0f) -> ClientId;
+
+	// Control thread. Once this returns the client is no longer referenced
+	auto remove(ClientId id) -> void;
+
+	// Any thread
+	auto set_gain(ClientId id, float gain) noexcept -> void;
+	auto get_stats(ClientId id) const noexcept -> ClientStats;
+	auto reset_peaks() noexcept -> void;
+
+	// Processor interface
+	auto prepare(const ProcessFormat& format) -> void;
+	auto process(const Block& block) noexcept -> int;
+
+private:
+
+	enum class SlotState
+	{
+		Empty,
+		Active,
+		Finished,
+	};
+
+	struct Slot
+	{
+		std::atomic<SlotState> state { SlotState::Empty };
+		Processor processor;
+		PlanarBuffer output;
+		std::atomic<float> gain { 1.0f };
+		float applied_gain {};
+		bool rendered {};
+		bool idle {};
+
+		std::atomic<double> load {};
+		std::atomic<double> peak_load {};
+		std::atomic<std::uint64_t> blocks {};
+	};
+
+	// Weight of the newest block in the smoothed load
+	static constexpr double LOAD_SMOOTHING { 0.1 };
+
+	auto allocate(Slot& slot) -> void;
+	auto mix(const Block& block) noexcept -> bool;
+	auto render(Slot& slot, const Block& block, bool audio_thread) noexcept -> void;
+	auto render_all(const Block& block) noexcept -> void;
+	auto synchronize() const -> void;
+	auto valid(ClientId id) const noexcept -> bool;
+	auto work_loop() -> void;
+
+	Config config_;
+	std::unique_ptr<Slot[]> slots_;
+	ProcessFormat format_ {};
+	unsigned long frames_ {};
+	bool prepared_ {};
+
+	// Channel pointers for the piece of the block being rendered
+	std::vector<const float*> piece_input_;
+	std::vector<float*> piece_output_;
+
+	// Odd while process() is running, so remove() knows when the audio
+	// thread has let go of a client
+	std::atomic<std::uint64_t> epoch_ {};
+
+	// Parallel rendering. Slots are claimed from next_slot_ by whichever
+	// thread gets there first; the block is published by the release
+	// store that resets it
+	std::vector<std::thread> workers_;
+	Block current_ {};
+	std::atomic<std::uint32_t> generation_ {};
+	std::atomic<std::size_t> next_slot_ { 0 };
+	std::atomic<std::size_t> done_ { 0 };
+	std::atomic<bool> quit_ {};
+};
+
+inline Mixer::Mixer(Config config)
+	: config_ { config }
+	, slots_ { std::make_unique<Slot[]>(config.max_clients) }
+{
+	// Nothing to claim until the first block
+	next_slot_.store(config_.max_clients, std::memory_order_relaxed);
+
+	for (int i { 0 }; i < config_.worker_threads; i++)
+	{
+		workers_.emplace_back([this]() { work_loop(); });
+	}
+}
+
+inline Mixer::~Mixer()
+{
+	quit_.store(true, std::memory_order_release);
+	generation_.fetch_add(1, std::memory_order_release);
+	generation_.notify_all();
+
+	for (auto& worker : workers_)
+	{
+		worker.join();
+	}
+}
+
+template <class T>
+auto Mixer::add(T* processor, float gain) -> ClientId
+{
+	return add(bind_processor(processor), gain);
+}
+
+inline auto Mixer::add(Processor processor, float gain) -> ClientId
+{
+	for (std::size_t i { 0 }; i < config_.max_clients; i++)
+	{
+		auto& slot { slots_[i] };
+
+		if (slot.state.load(std::memory_order_acquire) != SlotState::Empty) continue;
+
+		slot.processor = processor;
+		slot.gain.store(gain, std::memory_order_relaxed);
+		slot.applied_gain = 0.0f;
+		slot.load.store(0.0, std::memory_order_relaxed);
+		slot.peak_load.store(0.0, std::memory_order_relaxed);
+		slot.blocks.store(0, std::memory_order_relaxed);
+
+		if (prepared_)
+		{
+			allocate(slot);
+
+			if (processor.prepare) processor.prepare(processor.object, format_);
+		}
+
+		// Everything above is published by this
+		slot.state.store(SlotState::Active, std::memory_order_release);
+
+		return ClientId(i);
+	}
+
+	return -1;
+}
+
+inline auto Mixer::remove(ClientId id) -> void
+{
+	if (!valid(id)) return;
+
+	auto& slot { slots_[id] };
+
+	slot.state.store(SlotState::Empty, std::memory_order_seq_cst);
+	synchronize();
+
+	slot.processor = {};
+}
+
+inline auto Mixer::set_gain(ClientId id, float gain) noexcept -> void
+{
+	if (!valid(id)) return;
+
+	slots_[id].gain.store(gain, std::memory_order_relaxed);
+}
+
+inline auto Mixer::get_stats(ClientId id) const noexcept -> ClientStats
+{
+	if (!valid(id)) return {};
+
+	const auto& slot { slots_[id] };
+
+	ClientStats out;
+
+	out.load = slot.load.load(std::memory_order_relaxed);
+	out.peak_load = slot.peak_load.load(std::memory_order_relaxed);
+	out.blocks = slot.blocks.load(std::memory_order_relaxed);
+	out.finished = slot.state.load(std::memory_order_acquire) == SlotState::Finished;
+
+	return out;
+}
+
+inline auto Mixer::reset_peaks() noexcept -> void
+{
+	for (std::size_t i { 0 }; i < config_.max_clients; i++)
+	{
+		slots_[i].peak_load.store(0.0, std::memory_order_relaxed);
+	}
+}
+
+// Control thread, before the stream opens
+inline auto Mixer::prepare(const ProcessFormat& format) -> void
+{
+	format_ = format;
+	frames_ = format.block_size > 0 ? format.block_size : format.frames_per_buffer > 0 ? format.frames_per_buffer : config_.max_frames;
+	prepared_ = true;
+
+	piece_input_.assign(std::size_t(format.input_channels), nullptr);
+	piece_output_.assign(std::size_t(format.output_channels), nullptr);
+
+	for (std::size_t i { 0 }; i < config_.max_clients; i++)
+	{
+		auto& slot { slots_[i] };
+
+		if (slot.state.load(std::memory_order_acquire) == SlotState::Empty) continue;
+
+		allocate(slot);
+
+		if (slot.processor.prepare) slot.processor.prepare(slot.processor.object, format_);
+	}
+}
+
+inline auto Mixer::allocate(Slot& slot) -> void
+{
+	if (!detail::channels_match(slot.processor.input_channels, format_.input_channels) ||
+	    !detail::channels_match(slot.processor.output_channels, format_.output_channels))
+	{
+		throw std::runtime_error("Mixer client's channel counts don't match the stream");
+	}
+
+	slot.output = { std::size_t(format_.output_channels), frames_ };
+}
+
+// Clients render into their own buffers, so a callback longer than the
+// buffers is handled in pieces
+inline auto Mixer::process(const Block& block) noexcept -> int
+{
+	auto idle { true };
+
+	epoch_.fetch_add(1, std::memory_order_seq_cst);
+
+	for (unsigned long offset { 0 }; offset < block.frame_count; offset += frames_)
+	{
+		for (std::size_t c { 0 }; c < piece_input_.size(); c++)
+		{
+			piece_input_[c] = block.input[c] + offset;
+		}
+
+		for (std::size_t c { 0 }; c < piece_output_.size(); c++)
+		{
+			piece_output_[c] = block.output[c] + offset;
+		}
+
+		Block piece { block };
+
+		piece.input = { piece_input_.data(), piece_input_.size() };
+		piece.output = { piece_output_.data(), piece_output_.size() };
+		piece.frame_count = std::min<unsigned long>(block.frame_count - offset, frames_);
+		piece.time.frame += offset;
+
+		render_all(piece);
+
+		if (!mix(piece)) idle = false;
+	}
+
+	epoch_.fetch_add(1, std::memory_order_release);
+
+	return idle ? process_idle : paContinue;
+}
+
+// True if every client which ran is idle
+inline auto Mixer::mix(const Block& block) noexcept -> bool
+{
+	auto idle { true };
+
+	for (const auto channel : block.output)
+	{
+		std::fill(channel, channel + block.frame_count, 0.0f);
+	}
+
+	for (std::size_t i { 0 }; i < config_.max_clients; i++)
+	{
+		auto& slot { slots_[i] };
+
+		if (!slot.rendered) continue;
+
+		slot.rendered = false;
+
+		if (!slot.idle) idle = false;
+
+		const auto gain { slot.gain.load(std::memory_order_relaxed) };
+
+		for (std::size_t c { 0 }; c < block.output.size(); c++)
+		{
+			simd::mix_add_ramp(block.output[c], slot.output.channel(c), block.frame_count, slot.applied_gain, gain);
+		}
+
+		slot.applied_gain = gain;
+	}
+
+	return idle;
+}
+
+// Scratch memory belongs to the audio thread, so clients running on a
+// worker don't get any
+inline auto Mixer::render(Slot& slot, const Block& block, bool audio_thread) noexcept -> void
+{
+	if (slot.state.load(std::memory_order_acquire) != SlotState::Active) return;
+
+	const auto start { std::chrono::steady_clock::now() };
+
+	Block piece { block };
+
+	piece.output = { slot.output.data(), slot.output.channels() };
+
+	if (!audio_thread) piece.scratch = nullptr;
+
+	const auto result { slot.processor.process(slot.processor.object, piece) };
+
+	slot.idle = result == process_idle;
+
+	if (result != paContinue && result != process_idle)
+	{
+		auto expected { SlotState::Active };
+
+		slot.state.compare_exchange_strong(expected, SlotState::Finished, std::memory_order_acq_rel);
+	}
+
+	slot.rendered = true;
+
+	const auto seconds { std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+	const auto load { format_.SR > 0.0 && block.frame_count > 0 ? seconds / (double(block.frame_count) / format_.SR) : 0.0 };
+	const auto smoothed { slot.load.load(std::memory_order_relaxed) };
+
+	slot.load.store(smoothed + ((load - smoothed) * LOAD_SMOOTHING), std::memory_order_relaxed);
+	slot.blocks.fetch_add(1, std::memory_order_relaxed);
+
+	if (load > slot.peak_load.load(std::memory_order_relaxed))
+	{
+		slot.peak_load.store(load, std::memory_order_relaxed);
+	}
+}
+
+inline auto Mixer::render_all(const Block& block) noexcept -> void
+{
+	if (workers_.empty())
+	{
+		for (std::size_t i { 0 }; i < config_.max_clients; i++)
+		{
+			render(slots_[i], block, true);
+		}
+
+		return;
+	}
+
+	current_ = block;
+	done_.store(0, std::memory_order_relaxed);
+	next_slot_.store(0, std::memory_order_release);
+	generation_.fetch_add(1, std::memory_order_release);
+	generation_.notify_all();
+
+	// Help out, then wait for whatever the workers claimed
+	for (;;)
+	{
+		const auto index { next_slot_.fetch_add(1, std::memory_order_acq_rel) };
+
+		if (index >= config_.max_clients) break;
+
+		render(slots_[index], block, true);
+		done_.fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	while (done_.load(std::memory_order_acquire) < config_.max_clients)
+	{
+		// Spin. The workers are busy with this block
+	}
+}
+
+inline auto Mixer::work_loop() -> void
+{
+	if (config_.worker_priority > 0) rt::detail::set_fifo(config_.worker_priority);
+
+	rt::detail::set_flush_denormals();
+
+	auto generation { generation_.load(std::memory_order_acquire) };
+
+	for (;;)
+	{
+		generation_.wait(generation, std::memory_order_acquire);
+		generation = generation_.load(std::memory_order_acquire);
+
+		if (quit_.load(std::memory_order_acquire)) return;
+
+		for (;;)
+		{
+			const auto index { next_slot_.fetch_add(1, std::memory_order_acq_rel) };
+
+			if (index >= config_.max_clients) break;
+
+			render(slots_[index], current_, false);
+			done_.fetch_add(1, std::memory_order_acq_rel);
+		}
+	}
+}
+
+inline auto Mixer::synchronize() const -> void
+{
+	const auto epoch { epoch_.load(std::memory_order_seq_cst) };
+
+	if ((epoch & 1) == 0) return;
+
+	while (epoch_.load(std::memory_order_acquire) == epoch)
+	{
+		std::this_thread::yield();
+	}
+}
+
+inline auto Mixer::valid(ClientId id) const noexcept -> bool
+{
+	return id >= 0 && std::size_t(id) < config_.max_clients;
+}
+
+} // pax
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include "simd.hpp"
+
+namespace pax {
+
+// Routes input channels straight to the output inside the stream's
+// callback, so performers can hear themselves without going through the
+// processor. Every setting is an atomic which the audio thread picks up
+// on the next callback, so any thread can change them at any time.
+// Gain, pan and output changes are ramped over a callback.
+//
+// Each input channel is panned (-1 left to 1 right, constant power)
+// between its output channel and the one after it. With a single output
+// channel the pan is ignored.
+//
+// Post mixes into the output after the processor has run, and adds no
+// latency. Pre fills the processor's output buffers with the monitor mix
+// before it runs, for processors which add into their output rather than
+// overwriting it. Pre goes through the block adapter like everything else
+// the processor sees, so with a block_size it has the adapter's latency.
+class Monitor
+{
+public:
+
+	enum class Position
+	{
+		Pre,
+		Post,
+	};
+
+	static constexpr std::size_t MAX_CHANNELS { 64 };
+
+	// Any thread. Out of range channels are ignored
+	auto set_enabled(bool enabled) noexcept -> void { enabled_.store(enabled, std::memory_order_relaxed); }
+	auto set_position(Position position) noexcept -> void { position_.store(position, std::memory_order_relaxed); }
+	auto set_channel_enabled(int input, bool enabled) noexcept -> void;
+	auto set_gain(int input, float gain) noexcept -> void;
+	auto set_pan(int input, float pan) noexcept -> void;
+	auto set_output(int input, int output) noexcept -> void;
+
+	auto get_position() const noexcept -> Position { return position_.load(std::memory_order_relaxed); }
+	auto is_enabled() const noexcept -> bool { return enabled_.load(std::memory_order_relaxed); }
+
+	// Audio thread. Adds the monitor mix to the output. Does nothing once
+	// everything has faded out
+	auto process(const float* const* input, std::size_t input_channels, float* const* output, std::size_t output_channels, unsigned long frame_count) noexcept -> void;
+
+	// While no stream is running. Routes fade in again from silence
+	auto reset() noexcept -> void;
+
+private:
+
+	struct Route
+	{
+		std::atomic<bool> enabled {};
+		std::atomic<float> gain { 1.0f };
+		std::atomic<float> pan {};
+		std::atomic<int> output {};
+
+		// Audio thread only
+		float applied_left {};
+		float applied_right {};
+		float applied_mono {};
+		std::size_t applied_output {};
+		bool applied_stereo {};
+	};
+
+	auto route(int input) noexcept -> Route*;
+
+	std::array<Route, MAX_CHANNELS> routes_;
+	std::atomic<bool> enabled_ {};
+	std::atomic<Position> position_ { Position::Post };
+};
+
+inline auto Monitor::route(int input) noexcept -> Route*
+{
+	if (input < 0 || std::size_t(input) >= MAX_CHANNELS) return nullptr;
+
+	return &routes_[input];
+}
+
+inline auto Monitor::set_channel_enabled(int input, bool enabled) noexcept -> void
+{
+	if (const auto r { route(input) }) r->enabled.store(enabled, std::memory_order_relaxed);
+}
+
+inline auto Monitor::set_gain(int input, float gain) noexcept -> void
+{
+	if (const auto r { route(input) }) r->gain.store(gain, std::memory_order_relaxed);
+}
+
+inline auto Monitor::set_pan(int input, float pan) noexcept -> void
+{
+	if (const auto r { route(input) }) r->pan.store(std::clamp(pan, -1.0f, 1.0f), std::memory_order_relaxed);
+}
+
+inline auto Monitor::set_output(int input, int output) noexcept -> void
+{
+	if (const auto r { route(input) }) r->output.store(std::max(output, 0), std::memory_order_relaxed);
+}
+
+inline auto Monitor::process(const float* const* input, std::size_t input_channels, float* const* output, std::size_t output_channels, unsigned long frame_count) noexcept -> void
+{
+	if (!input || output_channels < 1) return;
+
+	const auto enabled { enabled_.load(std::memory_order_relaxed) };
+	const auto channels { std::min(input_channels, MAX_CHANNELS) };
+
+	for (std::size_t c { 0 }; c < channels; c++)
+	{
+		auto& r { routes_[c] };
+
+		const auto gain { enabled && r.enabled.load(std::memory_order_relaxed) ? r.gain.load(std::memory_order_relaxed) : 0.0f };
+
+		const auto out { std::min(std::size_t(r.output.load(std::memory_order_relaxed)), output_channels - 1) };
+		const auto stereo { out + 1 < output_channels };
+
+		// Fade out of wherever the route was going, then fade in from
+		// silence at the new place
+		if (out != r.applied_output || stereo != r.applied_stereo)
+		{
+			if (r.applied_stereo && r.applied_output + 1 < output_channels && (r.applied_left != 0.0f || r.applied_right != 0.0f))
+			{
+				simd::mix_add_ramp(output[r.applied_output], input[c], frame_count, r.applied_left, 0.0f);
+				simd::mix_add_ramp(output[r.applied_output + 1], input[c], frame_count, r.applied_right, 0.0f);
+			}
+			else if (!r.applied_stereo && r.applied_output < output_channels && r.applied_mono != 0.0f)
+			{
+				simd::mix_add_ramp(output[r.applied_output], input[c], frame_count, r.applied_mono, 0.0f);
+			}
+
+			r.applied_left = 0.0f;
+			r.applied_right = 0.0f;
+			r.applied_mono = 0.0f;
+			r.applied_output = out;
+			r.applied_stereo = stereo;
+		}
+
+		if (stereo)
+		{
+			const auto angle { (r.pan.load(std::memory_order_relaxed) + 1.0f) * 0.25f * 3.14159265f };
+			const auto left { gain * std::cos(angle) };
+			const auto right { gain * std::sin(angle) };
+
+			if (left == 0.0f && right == 0.0f && r.applied_left == 0.0f && r.applied_right == 0.0f) continue;
+
+			simd::mix_add_ramp(output[out], input[c], frame_count, r.applied_left, left);
+			simd::mix_add_ramp(output[out + 1], input[c], frame_count, r.applied_right, right);
+
+			r.applied_left = left;
+			r.applied_right = right;
+		}
+		else
+		{
+			// Mono, or the last channel, so no pan
+			if (gain == 0.0f && r.applied_mono == 0.0f) continue;
+
+			simd::mix_add_ramp(output[out], input[c], frame_count, r.applied_mono, gain);
+
+			r.applied_mono = gain;
+		}
+	}
+}
+
+inline auto Monitor::reset() noexcept -> void
+{
+	for (auto& r : routes_)
+	{
+		r.applied_left = 0.0f;
+		r.applied_right = 0.0f;
+		r.applied_mono = 0.0f;
+		r.applied_output = 0;
+		r.applied_stereo = false;
+	}
+}
+
+} // pax
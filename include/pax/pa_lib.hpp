@@ -2,16 +2,97 @@
 
 #include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <portaudio.h>
+#include "trace.hpp"
 
 #ifdef _WIN32
 #include <pa_asio.h>
 #include <pa_win_wasapi.h>
 #endif
 
+// PortAudio ships these headers on every platform, but the functions
+// are only there if it was built with that host API. ALSA is assumed on
+// Linux (define PAX_NO_ALSA to leave it out), JACK has to be asked for
+// with PAX_WITH_JACK
+#if defined(__linux__) && !defined(PAX_NO_ALSA) && __has_include(<pa_linux_alsa.h>)
+#include <pa_linux_alsa.h>
+#define PAX_PA_ALSA
+#endif
+
+#if defined(PAX_WITH_JACK) && __has_include(<pa_jack.h>)
+#include <pa_jack.h>
+#define PAX_PA_JACK
+#endif
+
 namespace pax {
 namespace portaudio {
 
+// Result of a non-throwing PortAudio call. Pa_GetErrorText() returns
+// static strings so nothing is formatted or allocated unless the caller
+// asks for the message
+template <class T = void>
+struct Result
+{
+	PaError error { paNoError };
+	T value {};
+
+	explicit operator bool() const noexcept { return error >= 0; }
+	auto message() const noexcept -> const char*;
+};
+
+template <>
+struct Result<void>
+{
+	PaError error { paNoError };
+
+	explicit operator bool() const noexcept { return error >= 0; }
+	auto message() const noexcept -> const char*;
+};
+
+namespace detail {
+
+static inline auto error_message(PaError error) noexcept -> const char*
+{
+	if (error == paUnanticipatedHostError)
+	{
+		const auto info { Pa_GetLastHostErrorInfo() };
+
+		if (info && info->errorText) return info->errorText;
+	}
+
+	return Pa_GetErrorText(error);
+}
+
+template <class T>
+static inline auto make_result(PaError error, T value) noexcept -> Result<T>
+{
+	if (error < 0) return { error, {} };
+
+	return { paNoError, value };
+}
+
+template <class T>
+static inline auto make_null_result(T* value, PaError error) noexcept -> Result<T*>
+{
+	if (!value) return { error, nullptr };
+
+	return { paNoError, value };
+}
+
+} // detail
+
+template <class T>
+inline auto Result<T>::message() const noexcept -> const char*
+{
+	return detail::error_message(error);
+}
+
+inline auto Result<void>::message() const noexcept -> const char*
+{
+	return detail::error_message(error);
+}
+
 class Library
 {
 public:
@@ -50,12 +131,60 @@ public:
 		{
 			static auto IsLoopback(PaDeviceIndex device) -> int;
 		};
+
+		// These throw if PortAudio wasn't built with ALSA. The periods and
+		// busy retries are global and apply to streams opened afterwards
+		struct ALSA
+		{
+			static constexpr int DEFAULT_PERIODS { 4 };
+			static constexpr int DEFAULT_RETRIES_BUSY { 100 };
+
+			static auto EnableRealtimeScheduling(PaStream* stream, bool enable) -> void;
+			static auto SetNumPeriods(int periods) -> void;
+			static auto SetRetriesBusy(int retries) -> void;
+
+			// Not every device belongs to a card, so these don't throw
+			static auto GetStreamInputCard(PaStream* stream) noexcept -> Result<int>;
+			static auto GetStreamOutputCard(PaStream* stream) noexcept -> Result<int>;
+		};
+
+		// The client name has to be set before PortAudio is initialized,
+		// i.e. before the first System is created
+		struct JACK
+		{
+			static auto GetClientName() -> const char*;
+			static auto SetClientName(const char* name) -> void;
+		};
+
+		// Same calls, but errors are returned instead of thrown. Use these
+		// from pollers and teardown paths
+		struct NoThrow
+		{
+			static auto AbortStream(PaStream* stream) noexcept -> Result<>;
+			static auto CloseStream(PaStream* stream) noexcept -> Result<>;
+			static auto GetDefaultHostApi() noexcept -> Result<PaHostApiIndex>;
+			static auto GetDeviceInfo(PaDeviceIndex device) noexcept -> Result<const PaDeviceInfo*>;
+			static auto GetHostApiCount() noexcept -> Result<PaHostApiIndex>;
+			static auto GetHostApiInfo(PaHostApiIndex hostApi) noexcept -> Result<const PaHostApiInfo*>;
+			static auto GetStreamInfo(PaStream* stream) noexcept -> Result<const PaStreamInfo*>;
+			static auto HostApiDeviceIndexToDeviceIndex(PaHostApiIndex hostApi, int hostApiDeviceIndex) noexcept -> Result<PaDeviceIndex>;
+			static auto HostApiTypeIdToHostApiIndex(PaHostApiTypeId type) noexcept -> Result<PaHostApiIndex>;
+			static auto Initialize() noexcept -> Result<>;
+			static auto IsStreamActive(PaStream* stream) noexcept -> Result<bool>;
+			static auto IsStreamStopped(PaStream* stream) noexcept -> Result<bool>;
+			static auto OpenStream(PaStream** stream, const PaStreamParameters* inputParameters, const PaStreamParameters* outputParameters, double sampleRate, unsigned long framesPerBuffer, PaStreamFlags streamFlags, PaStreamCallback* streamCallback, void* userData) noexcept -> Result<>;
+			static auto SetStreamFinishedCallback(PaStream* stream, PaStreamFinishedCallback* streamFinishedCallback) noexcept -> Result<>;
+			static auto StartStream(PaStream* stream) noexcept -> Result<>;
+			static auto StopStream(PaStream* stream) noexcept -> Result<>;
+			static auto Terminate() noexcept -> Result<>;
+		};
     };
 
 private:
 
     template <class T>
-    static auto check_error(T result) -> T;
+    static auto check_result(const Result<T>& result) -> T;
+    static auto check_result(const Result<>& result) -> void;
 
 	template <class T>
     static auto check_null_result(T* result, const std::string& func) -> T*;
@@ -80,42 +209,46 @@ inline auto Library::C::GetErrorText(PaError errorCode) -> const char*
 
 inline auto Library::C::Initialize() -> void
 {
-	check_error(Pa_Initialize());
+	trace::Span span { "Pa_Initialize", "system" };
+
+	check_result(NoThrow::Initialize());
 }
 
 inline auto Library::C::Terminate() -> void
 {
-	check_error(Pa_Terminate());
+	trace::Span span { "Pa_Terminate", "system" };
+
+	check_result(NoThrow::Terminate());
 }
 
 inline auto Library::C::GetHostApiCount() -> PaHostApiIndex
 {
-	return check_error(Pa_GetHostApiCount());
+	return check_result(NoThrow::GetHostApiCount());
 }
 
 inline auto Library::C::GetDefaultHostApi() -> PaHostApiIndex
 {
-	return check_error(Pa_GetDefaultHostApi());
+	return check_result(NoThrow::GetDefaultHostApi());
 }
 
 inline auto Library::C::GetHostApiInfo(PaHostApiIndex hostApi) -> const PaHostApiInfo*
 {
-	return check_null_result(Pa_GetHostApiInfo(hostApi), "Pa_GetHostApiInfo");
+	return check_null_result(NoThrow::GetHostApiInfo(hostApi).value, "Pa_GetHostApiInfo");
 }
 
 inline auto Library::C::HostApiTypeIdToHostApiIndex(PaHostApiTypeId type) -> PaHostApiIndex
 {
-	return check_error(Pa_HostApiTypeIdToHostApiIndex(type));
+	return check_result(NoThrow::HostApiTypeIdToHostApiIndex(type));
 }
 
 inline auto Library::C::HostApiDeviceIndexToDeviceIndex(PaHostApiIndex hostApi, int hostApiDeviceIndex) -> PaDeviceIndex
 {
-	return check_error(Pa_HostApiDeviceIndexToDeviceIndex(hostApi, hostApiDeviceIndex));
+	return check_result(NoThrow::HostApiDeviceIndexToDeviceIndex(hostApi, hostApiDeviceIndex));
 }
 
 inline auto Library::C::SetStreamFinishedCallback(PaStream* stream, PaStreamFinishedCallback* streamFinishedCallback) -> void
 {
-	check_error(Pa_SetStreamFinishedCallback(stream, streamFinishedCallback));
+	check_result(NoThrow::SetStreamFinishedCallback(stream, streamFinishedCallback));
 }
 
 inline auto Library::C::GetDefaultInputDevice() -> PaDeviceIndex
@@ -135,7 +268,7 @@ inline auto Library::C::GetDeviceCount() -> PaDeviceIndex
 
 inline auto Library::C::GetDeviceInfo(PaDeviceIndex device) -> const PaDeviceInfo*
 {
-	return check_null_result(Pa_GetDeviceInfo(device), "Pa_GetDeviceInfo");
+	return check_null_result(NoThrow::GetDeviceInfo(device).value, "Pa_GetDeviceInfo");
 }
 
 inline auto Library::C::GetLastHostErrorInfo() -> const PaHostErrorInfo*
@@ -145,47 +278,49 @@ inline auto Library::C::GetLastHostErrorInfo() -> const PaHostErrorInfo*
 
 inline auto Library::C::IsFormatSupported(const PaStreamParameters* inputParameters, const PaStreamParameters* outputParameters, double sampleRate) -> PaError
 {
+	trace::Span span { "Pa_IsFormatSupported", "probe", "sample_rate", std::int64_t(sampleRate) };
+
 	return Pa_IsFormatSupported(inputParameters, outputParameters, sampleRate);
 }
 
 inline auto Library::C::OpenStream(PaStream** stream, const PaStreamParameters* inputParameters, const PaStreamParameters* outputParameters, double sampleRate, unsigned long framesPerBuffer, PaStreamFlags streamFlags, PaStreamCallback* streamCallback, void* userData) -> void
 {
-	check_error(Pa_OpenStream(stream, inputParameters, outputParameters, sampleRate, framesPerBuffer, streamFlags, streamCallback, userData));
+	check_result(NoThrow::OpenStream(stream, inputParameters, outputParameters, sampleRate, framesPerBuffer, streamFlags, streamCallback, userData));
 }
 
 inline auto Library::C::CloseStream(PaStream* stream) -> void
 {
-	check_error(Pa_CloseStream(stream));
+	check_result(NoThrow::CloseStream(stream));
 }
 
 inline auto Library::C::StartStream(PaStream* stream) -> void
 {
-	check_error(Pa_StartStream(stream));
+	check_result(NoThrow::StartStream(stream));
 }
 
 inline auto Library::C::StopStream(PaStream* stream) -> void
 {
-	check_error(Pa_StopStream(stream));
+	check_result(NoThrow::StopStream(stream));
 }
 
 inline auto Library::C::AbortStream(PaStream* stream) -> void
 {
-	check_error(Pa_AbortStream(stream));
+	check_result(NoThrow::AbortStream(stream));
 }
 
 inline auto Library::C::IsStreamStopped(PaStream* stream) -> PaError
 {
-	return check_error(Pa_IsStreamStopped(stream));
+	return check_result(NoThrow::IsStreamStopped(stream)) ? 1 : 0;
 }
 
 inline auto Library::C::IsStreamActive(PaStream* stream) -> PaError
 {
-	return check_error(Pa_IsStreamActive(stream));
+	return check_result(NoThrow::IsStreamActive(stream)) ? 1 : 0;
 }
 
 inline auto Library::C::GetStreamInfo(PaStream* stream) -> const PaStreamInfo*
 {
-	return check_null_result(Pa_GetStreamInfo(stream), "Pa_GetStreamInfo");
+	return check_null_result(NoThrow::GetStreamInfo(stream).value, "Pa_GetStreamInfo");
 }
 
 inline auto Library::C::GetStreamTime(PaStream* stream) -> PaTime
@@ -198,7 +333,7 @@ inline auto Library::C::GetStreamCpuLoad(PaStream* stream) -> double
 	return Pa_GetStreamCpuLoad(stream);
 }
 
-inline auto Library::C::WASAPI::IsLoopback(PaDeviceIndex device) -> int
+inline auto Library::C::WASAPI::IsLoopback([[maybe_unused]] PaDeviceIndex device) -> int
 {
 #ifdef _WIN32
 	return PaWasapi_IsLoopback(device);
@@ -207,15 +342,195 @@ inline auto Library::C::WASAPI::IsLoopback(PaDeviceIndex device) -> int
 #endif
 }
 
+inline auto Library::C::ALSA::EnableRealtimeScheduling([[maybe_unused]] PaStream* stream, [[maybe_unused]] bool enable) -> void
+{
+#ifdef PAX_PA_ALSA
+	PaAlsa_EnableRealtimeScheduling(stream, enable ? 1 : 0);
+#else
+	throw std::runtime_error("PortAudio ALSA support is not available");
+#endif
+}
+
+inline auto Library::C::ALSA::SetNumPeriods([[maybe_unused]] int periods) -> void
+{
+#ifdef PAX_PA_ALSA
+	check_result(Result<> { PaAlsa_SetNumPeriods(periods) });
+#else
+	throw std::runtime_error("PortAudio ALSA support is not available");
+#endif
+}
+
+inline auto Library::C::ALSA::SetRetriesBusy([[maybe_unused]] int retries) -> void
+{
+#ifdef PAX_PA_ALSA
+	check_result(Result<> { PaAlsa_SetRetriesBusy(retries) });
+#else
+	throw std::runtime_error("PortAudio ALSA support is not available");
+#endif
+}
+
+inline auto Library::C::ALSA::GetStreamInputCard([[maybe_unused]] PaStream* stream) noexcept -> Result<int>
+{
+#ifdef PAX_PA_ALSA
+	int card { -1 };
+
+	const auto result { PaAlsa_GetStreamInputCard(stream, &card) };
+
+	return detail::make_result(result, card);
+#else
+	return { paHostApiNotFound };
+#endif
+}
+
+inline auto Library::C::ALSA::GetStreamOutputCard([[maybe_unused]] PaStream* stream) noexcept -> Result<int>
+{
+#ifdef PAX_PA_ALSA
+	int card { -1 };
+
+	const auto result { PaAlsa_GetStreamOutputCard(stream, &card) };
+
+	return detail::make_result(result, card);
+#else
+	return { paHostApiNotFound };
+#endif
+}
+
+inline auto Library::C::JACK::GetClientName() -> const char*
+{
+#ifdef PAX_PA_JACK
+	const char* name {};
+
+	check_result(Result<> { PaJack_GetClientName(&name) });
+
+	return name;
+#else
+	throw std::runtime_error("PortAudio JACK support is not available");
+#endif
+}
+
+inline auto Library::C::JACK::SetClientName([[maybe_unused]] const char* name) -> void
+{
+#ifdef PAX_PA_JACK
+	check_result(Result<> { PaJack_SetClientName(name) });
+#else
+	throw std::runtime_error("PortAudio JACK support is not available");
+#endif
+}
+
+inline auto Library::C::NoThrow::Initialize() noexcept -> Result<>
+{
+	return { Pa_Initialize() };
+}
+
+inline auto Library::C::NoThrow::Terminate() noexcept -> Result<>
+{
+	return { Pa_Terminate() };
+}
+
+inline auto Library::C::NoThrow::GetHostApiCount() noexcept -> Result<PaHostApiIndex>
+{
+	const auto result { Pa_GetHostApiCount() };
+
+	return detail::make_result(result, result);
+}
+
+inline auto Library::C::NoThrow::GetDefaultHostApi() noexcept -> Result<PaHostApiIndex>
+{
+	const auto result { Pa_GetDefaultHostApi() };
+
+	return detail::make_result(result, result);
+}
+
+inline auto Library::C::NoThrow::GetHostApiInfo(PaHostApiIndex hostApi) noexcept -> Result<const PaHostApiInfo*>
+{
+	return detail::make_null_result(Pa_GetHostApiInfo(hostApi), paInvalidHostApi);
+}
+
+inline auto Library::C::NoThrow::HostApiTypeIdToHostApiIndex(PaHostApiTypeId type) noexcept -> Result<PaHostApiIndex>
+{
+	const auto result { Pa_HostApiTypeIdToHostApiIndex(type) };
+
+	return detail::make_result(result, result);
+}
+
+inline auto Library::C::NoThrow::HostApiDeviceIndexToDeviceIndex(PaHostApiIndex hostApi, int hostApiDeviceIndex) noexcept -> Result<PaDeviceIndex>
+{
+	const auto result { Pa_HostApiDeviceIndexToDeviceIndex(hostApi, hostApiDeviceIndex) };
+
+	return detail::make_result(result, result);
+}
+
+inline auto Library::C::NoThrow::SetStreamFinishedCallback(PaStream* stream, PaStreamFinishedCallback* streamFinishedCallback) noexcept -> Result<>
+{
+	return { Pa_SetStreamFinishedCallback(stream, streamFinishedCallback) };
+}
+
+inline auto Library::C::NoThrow::GetDeviceInfo(PaDeviceIndex device) noexcept -> Result<const PaDeviceInfo*>
+{
+	return detail::make_null_result(Pa_GetDeviceInfo(device), paInvalidDevice);
+}
+
+inline auto Library::C::NoThrow::OpenStream(PaStream** stream, const PaStreamParameters* inputParameters, const PaStreamParameters* outputParameters, double sampleRate, unsigned long framesPerBuffer, PaStreamFlags streamFlags, PaStreamCallback* streamCallback, void* userData) noexcept -> Result<>
+{
+	return { Pa_OpenStream(stream, inputParameters, outputParameters, sampleRate, framesPerBuffer, streamFlags, streamCallback, userData) };
+}
+
+inline auto Library::C::NoThrow::CloseStream(PaStream* stream) noexcept -> Result<>
+{
+	return { Pa_CloseStream(stream) };
+}
+
+inline auto Library::C::NoThrow::StartStream(PaStream* stream) noexcept -> Result<>
+{
+	return { Pa_StartStream(stream) };
+}
+
+inline auto Library::C::NoThrow::StopStream(PaStream* stream) noexcept -> Result<>
+{
+	return { Pa_StopStream(stream) };
+}
+
+inline auto Library::C::NoThrow::AbortStream(PaStream* stream) noexcept -> Result<>
+{
+	return { Pa_AbortStream(stream) };
+}
+
+inline auto Library::C::NoThrow::IsStreamStopped(PaStream* stream) noexcept -> Result<bool>
+{
+	const auto result { Pa_IsStreamStopped(stream) };
+
+	return detail::make_result(result, result == 1);
+}
+
+inline auto Library::C::NoThrow::IsStreamActive(PaStream* stream) noexcept -> Result<bool>
+{
+	const auto result { Pa_IsStreamActive(stream) };
+
+	return detail::make_result(result, result == 1);
+}
+
+inline auto Library::C::NoThrow::GetStreamInfo(PaStream* stream) noexcept -> Result<const PaStreamInfo*>
+{
+	return detail::make_null_result(Pa_GetStreamInfo(stream), paBadStreamPtr);
+}
+
 template <class T>
-inline auto Library::check_error(T result) -> T
+inline auto Library::check_result(const Result<T>& result) -> T
 {
-	if (result < 0)
+	if (!result)
 	{
-		throw_runtime_error(result);
+		throw_runtime_error(result.error);
 	}
 
-	return result;
+	return result.value;
+}
+
+inline auto Library::check_result(const Result<>& result) -> void
+{
+	if (!result)
+	{
+		throw_runtime_error(result.error);
+	}
 }
 
 template <class T>
@@ -237,7 +552,7 @@ inline auto Library::throw_runtime_error(PaError errorCode) -> void
 {
 	std::stringstream ss;
 
-	ss << "PortAudio error: " << C::GetErrorText(errorCode);
+	ss << "PortAudio error: " << detail::error_message(errorCode);
 
 	throw std::runtime_error(ss.str());
 }
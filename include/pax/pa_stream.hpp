@@ -1,5 +1,6 @@
 #pragma once
 
+#include <type_traits>
 #include "pa_lib.hpp"
 
 namespace pax {
@@ -39,6 +40,11 @@ public:
 	auto start() -> void;
 	auto stop() -> void;
 	auto is_active() const -> bool;
+
+	auto try_abort() noexcept -> Result<>;
+	auto try_start() noexcept -> Result<>;
+	auto try_stop() noexcept -> Result<>;
+	auto try_is_active() const noexcept -> Result<bool>;
 	auto set_finished_callback(PaStreamFinishedCallback* streamFinishedCallback) -> void;
 
 	auto get_time() -> PaTime;
@@ -60,6 +66,8 @@ static inline auto open_stream(const Stream::Config& config)
 
 		for (int i = 0; i < MAX_ATTEMPTS; i++)
 		{
+			trace::Span span { "Pa_OpenStream", "stream", "attempt", i };
+
 			err =
 				Pa_OpenStream(
 					stream,
@@ -93,6 +101,21 @@ static inline auto open_stream(const Stream::Config& config)
 	return out;
 }
 
+template <class T>
+static inline auto check(const Result<T>& result) -> T
+{
+	if (!result)
+	{
+		std::stringstream ss;
+
+		ss << "PortAudio error: " << result.message();
+
+		throw std::runtime_error(ss.str());
+	}
+
+	if constexpr (!std::is_void_v<T>) return result.value;
+}
+
 static inline auto get_info(PaStream* stream)
 {
 	Stream::Info out;
@@ -106,8 +129,22 @@ static inline auto get_info(PaStream* stream)
 	return out;
 }
 
-static inline auto get_host_type(const Stream::Config& config)
+static inline auto get_host_type(const Stream::Config& config) -> PaHostApiTypeId
 {
+	// Devices given by host-specific strings have no index, but every
+	// host's stream info starts with the same header naming the host
+	if (config.output_parameters->device == paUseHostApiSpecificDeviceSpecification)
+	{
+		struct Header
+		{
+			unsigned long size;
+			PaHostApiTypeId hostApiType;
+			unsigned long version;
+		};
+
+		return static_cast<const Header*>(config.output_parameters->hostApiSpecificStreamInfo)->hostApiType;
+	}
+
 	const auto device_info { Library::C::GetDeviceInfo(config.output_parameters->device) };
 	const auto host_info { Library::C::GetHostApiInfo(device_info->hostApi) };
 
@@ -125,51 +162,83 @@ inline Stream::Stream(const Config& config)
 
 inline Stream::~Stream()
 {
-	Library::C::CloseStream(stream);
+	trace::Span span { "Pa_CloseStream", "stream" };
+
+	// Destructors can't throw, and there's nothing useful to do about
+	// a failed close anyway
+	Library::C::NoThrow::CloseStream(stream);
 }
 
 inline auto Stream::abort() -> void
 {
-	if (is_active())
-	{
-		Library::C::AbortStream(stream);
-	}
+	detail::check(try_abort());
 }
 
 inline auto Stream::start() -> void
 {
-	Library::C::StartStream(stream);
+	detail::check(try_start());
 }
 
 inline auto Stream::stop() -> void
 {
-	if (is_active())
-	{
-		if (host_type == paDirectSound)
-		{
-			// Can get stuck while waiting for the stream to stop
-			// due to an unknown Windows or PortAudio bug i guess
-			// So just abort instead
-			Library::C::AbortStream(stream);
-			return;
-		}
+	detail::check(try_stop());
+}
 
-		if (host_type == paMME)
-		{
-			// Likewise MME will always get stuck if you try to stop
-			// cleanly AFAIK due to a PortAudio bug which I can't be
-			// bothered to report
-			Library::C::AbortStream(stream);
-			return;
-		}
+inline auto Stream::is_active() const -> bool
+{
+	return detail::check(try_is_active());
+}
+
+inline auto Stream::try_abort() noexcept -> Result<>
+{
+	const auto active { try_is_active() };
+
+	if (!active) return { active.error };
+	if (!active.value) return {};
+
+	trace::Span span { "Pa_AbortStream", "stream" };
+
+	return Library::C::NoThrow::AbortStream(stream);
+}
+
+inline auto Stream::try_start() noexcept -> Result<>
+{
+	trace::Span span { "Pa_StartStream", "stream" };
 
-		Library::C::StopStream(stream);
+	return Library::C::NoThrow::StartStream(stream);
+}
+
+inline auto Stream::try_stop() noexcept -> Result<>
+{
+	const auto active { try_is_active() };
+
+	if (!active) return { active.error };
+	if (!active.value) return {};
+
+	trace::Span span { "Pa_StopStream", "stream", "host_type", host_type };
+
+	if (host_type == paDirectSound)
+	{
+		// Can get stuck while waiting for the stream to stop
+		// due to an unknown Windows or PortAudio bug i guess
+		// So just abort instead
+		return Library::C::NoThrow::AbortStream(stream);
+	}
+
+	if (host_type == paMME)
+	{
+		// Likewise MME will always get stuck if you try to stop
+		// cleanly AFAIK due to a PortAudio bug which I can't be
+		// bothered to report
+		return Library::C::NoThrow::AbortStream(stream);
 	}
+
+	return Library::C::NoThrow::StopStream(stream);
 }
 
-inline auto Stream::is_active() const -> bool
+inline auto Stream::try_is_active() const noexcept -> Result<bool>
 {
-	return Library::C::IsStreamActive(stream) == 1;
+	return Library::C::NoThrow::IsStreamActive(stream);
 }
 
 inline auto Stream::set_finished_callback(PaStreamFinishedCallback* streamFinishedCallback) -> void
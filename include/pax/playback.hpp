@@ -0,0 +1,638 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "processor.hpp"
+#include "seqlock.hpp"
+
+#ifdef _WIN32
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#else
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+namespace pax {
+namespace detail {
+
+// Read-only view of a whole file
+class MappedFile
+{
+public:
+
+	MappedFile() = default;
+	MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	auto operator=(const MappedFile&) -> MappedFile& = delete;
+
+	auto data() const -> const std::byte* { return data_; }
+	auto size() const -> std::size_t { return size_; }
+
+	// Hints only
+	auto will_need(std::size_t offset, std::size_t size) const -> void;
+	auto dont_need(std::size_t offset, std::size_t size) const -> void;
+
+private:
+
+	const std::byte* data_ {};
+	std::size_t size_ {};
+#ifdef _WIN32
+	HANDLE file_ { INVALID_HANDLE_VALUE };
+	HANDLE mapping_ {};
+#endif
+};
+
+static constexpr std::size_t MAP_PAGE_SIZE { 4096 };
+
+#ifdef _WIN32
+
+inline MappedFile::MappedFile(const std::string& path)
+{
+	file_ = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file_ == INVALID_HANDLE_VALUE) throw std::runtime_error("Couldn't open " + path);
+
+	LARGE_INTEGER size;
+
+	::GetFileSizeEx(file_, &size);
+
+	size_ = std::size_t(size.QuadPart);
+	mapping_ = ::CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+	if (!mapping_)
+	{
+		::CloseHandle(file_);
+		throw std::runtime_error("Couldn't map " + path);
+	}
+
+	data_ = static_cast<const std::byte*>(::MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+
+	if (!data_)
+	{
+		::CloseHandle(mapping_);
+		::CloseHandle(file_);
+		throw std::runtime_error("Couldn't map " + path);
+	}
+}
+
+inline MappedFile::~MappedFile()
+{
+	if (!data_) return;
+
+	::UnmapViewOfFile(data_);
+	::CloseHandle(mapping_);
+	::CloseHandle(file_);
+}
+
+// Windows has no equivalent we can rely on, the prefetch thread touching
+// the pages does the work
+inline auto MappedFile::will_need(std::size_t, std::size_t) const -> void {}
+inline auto MappedFile::dont_need(std::size_t, std::size_t) const -> void {}
+
+#else
+
+inline MappedFile::MappedFile(const std::string& path)
+{
+	const auto fd { ::open(path.c_str(), O_RDONLY) };
+
+	if (fd < 0) throw std::runtime_error("Couldn't open " + path + ": " + std::strerror(errno));
+
+	struct stat st;
+
+	if (::fstat(fd, &st) != 0 || st.st_size < 1)
+	{
+		::close(fd);
+		throw std::runtime_error("Couldn't open " + path + ": empty or unreadable");
+	}
+
+	size_ = std::size_t(st.st_size);
+
+	const auto ptr { ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) };
+
+	// The mapping keeps its own reference to the file
+	::close(fd);
+
+	if (ptr == MAP_FAILED) throw std::runtime_error("Couldn't map " + path + ": " + std::strerror(errno));
+
+	data_ = static_cast<const std::byte*>(ptr);
+}
+
+inline MappedFile::~MappedFile()
+{
+	if (!data_) return;
+
+	::munmap(const_cast<std::byte*>(data_), size_);
+}
+
+inline auto MappedFile::will_need(std::size_t offset, std::size_t size) const -> void
+{
+	const auto begin { offset / MAP_PAGE_SIZE * MAP_PAGE_SIZE };
+	const auto end { std::min(offset + size, size_) };
+
+	if (end <= begin) return;
+
+	::madvise(const_cast<std::byte*>(data_ + begin), end - begin, MADV_WILLNEED);
+}
+
+inline auto MappedFile::dont_need(std::size_t offset, std::size_t size) const -> void
+{
+	// Only whole pages inside the range, so nothing still wanted goes
+	const auto begin { (offset + MAP_PAGE_SIZE - 1) / MAP_PAGE_SIZE * MAP_PAGE_SIZE };
+	const auto end { (offset + size) / MAP_PAGE_SIZE * MAP_PAGE_SIZE };
+
+	if (end <= begin) return;
+
+	::madvise(const_cast<std::byte*>(data_ + begin), end - begin, MADV_DONTNEED);
+}
+
+#endif
+
+enum class SampleFormat
+{
+	Int16,
+	Int24,
+	Int32,
+	Float32,
+};
+
+struct WavInfo
+{
+	SampleFormat format {};
+	int channels {};
+	int SR {};
+	std::size_t data_offset {};
+	std::uint64_t frames {};
+
+	auto frame_bytes() const -> std::size_t;
+};
+
+inline auto WavInfo::frame_bytes() const -> std::size_t
+{
+	switch (format)
+	{
+		case SampleFormat::Int16: return std::size_t(channels) * 2;
+		case SampleFormat::Int24: return std::size_t(channels) * 3;
+		default: return std::size_t(channels) * 4;
+	}
+}
+
+static inline auto get_le(const std::byte* src, int bytes) -> std::uint64_t
+{
+	std::uint64_t out {};
+
+	for (int i { 0 }; i < bytes; i++)
+	{
+		out |= std::uint64_t(src[i]) << (8 * i);
+	}
+
+	return out;
+}
+
+// Handles RIFF and RF64, PCM 16/24/32 bit and 32-bit float, including
+// WAVE_FORMAT_EXTENSIBLE
+static inline auto parse_wav(const std::byte* data, std::size_t size) -> WavInfo
+{
+	const auto id { [data](std::size_t offset, const char* expected) { return std::memcmp(data + offset, expected, 4) == 0; } };
+
+	if (size < 12 || !(id(0, "RIFF") || id(0, "RF64")) || !id(8, "WAVE"))
+	{
+		throw std::runtime_error("Not a WAV file");
+	}
+
+	WavInfo out;
+
+	std::uint64_t ds64_data_size {};
+	auto have_format { false };
+	std::size_t offset { 12 };
+
+	while (offset + 8 <= size)
+	{
+		auto chunk_size { get_le(data + offset + 4, 4) };
+
+		const auto body { offset + 8 };
+
+		// Only the data chunk is allowed to run past the end, since that's
+		// what a recording which was cut short looks like
+		if (!id(offset, "data") && chunk_size > size - body)
+		{
+			throw std::runtime_error("Truncated WAV file");
+		}
+
+		if (id(offset, "ds64") && chunk_size >= 16)
+		{
+			ds64_data_size = get_le(data + body + 8, 8);
+		}
+		else if (id(offset, "fmt ") && chunk_size >= 16)
+		{
+			auto tag { get_le(data + body, 2) };
+
+			const auto bits { get_le(data + body + 14, 2) };
+
+			// WAVE_FORMAT_EXTENSIBLE, the real tag starts the subformat GUID
+			if (tag == 0xfffe && chunk_size >= 40) tag = get_le(data + body + 24, 2);
+
+			out.channels = int(get_le(data + body + 2, 2));
+			out.SR = int(get_le(data + body + 4, 4));
+
+			if (tag == 1 && bits == 16) out.format = SampleFormat::Int16;
+			else if (tag == 1 && bits == 24) out.format = SampleFormat::Int24;
+			else if (tag == 1 && bits == 32) out.format = SampleFormat::Int32;
+			else if (tag == 3 && bits == 32) out.format = SampleFormat::Float32;
+			else throw std::runtime_error("Unsupported WAV sample format");
+
+			have_format = true;
+		}
+		else if (id(offset, "data"))
+		{
+			if (!have_format || out.channels < 1) throw std::runtime_error("WAV data chunk before format chunk");
+
+			if (chunk_size == 0xffffffff && ds64_data_size > 0) chunk_size = ds64_data_size;
+
+			out.data_offset = body;
+			out.frames = std::min<std::uint64_t>(chunk_size, size - body) / out.frame_bytes();
+
+			return out;
+		}
+
+		offset = body + chunk_size + (chunk_size & 1);
+	}
+
+	throw std::runtime_error("WAV file has no data");
+}
+
+static inline auto read_sample(const std::byte* src, SampleFormat format) -> float
+{
+	switch (format)
+	{
+		case SampleFormat::Int16:
+		{
+			return float(std::int16_t(get_le(src, 2))) * (1.0f / 32768.0f);
+		}
+		case SampleFormat::Int24:
+		{
+			const auto value { std::int32_t(std::uint32_t(get_le(src, 3)) << 8) >> 8 };
+
+			return float(value) * (1.0f / 8388608.0f);
+		}
+		case SampleFormat::Int32:
+		{
+			return float(double(std::int32_t(get_le(src, 4))) * (1.0 / 2147483648.0));
+		}
+		default:
+		{
+			float out;
+
+			std::memcpy(&out, src, sizeof(float));
+
+			return out;
+		}
+	}
+}
+
+} // detail
+
+// Plays a WAV file straight out of a memory mapping, converting to float
+// as it goes, so there's no intermediate buffering or copying. A prefetch
+// thread keeps the pages ahead of the play head resident (madvise plus
+// touching every page) and lets go of the ones far behind it.
+//
+// The audio thread only reads frames inside the window the prefetch
+// thread has published as resident. If playback ever gets ahead of the
+// prefetcher it outputs silence for the missing frames and counts a
+// miss, rather than taking a page fault which could block on disk.
+//
+// Use it as the stream's processor with set_processor(&player), or call
+// process() from another processor. Files are played at their own rate
+// without resampling. Mono files go to every output channel.
+class FilePlayer
+{
+public:
+
+	struct Config
+	{
+		std::string path;
+
+		// How far ahead of the play head to keep resident
+		double prefetch_seconds { 2.0 };
+
+		// Pages further behind the play head than this are released
+		double keep_behind_seconds { 1.0 };
+
+		// How much to pre-fault after a seek before it takes effect
+		double seek_preroll_seconds { 0.25 };
+	};
+
+	FilePlayer(Config config);
+	~FilePlayer();
+
+	FilePlayer(const FilePlayer&) = delete;
+	auto operator=(const FilePlayer&) -> FilePlayer& = delete;
+
+	auto channels() const -> int { return info_.channels; }
+	auto frames() const -> std::uint64_t { return info_.frames; }
+	auto SR() const -> int { return info_.SR; }
+
+	// Control thread. seek() hands the target to the prefetch thread,
+	// which pre-faults around it before the audio thread jumps there.
+	// With wait set, blocks until the seek has been published
+	auto play() -> void;
+	auto pause() -> void;
+	auto seek(std::uint64_t frame, bool wait = false) -> void;
+	auto get_misses() const -> std::uint64_t { return misses_.load(std::memory_order_relaxed); }
+	auto get_position() const -> std::uint64_t { return current_position(); }
+	auto finished() const -> bool { return get_position() >= frames(); }
+
+	// Audio thread
+	auto process(const Block& block) noexcept -> int;
+
+private:
+
+	// Frames [begin, end) are resident. A new generation tells the audio
+	// thread to jump to seek_frame
+	struct Window
+	{
+		std::uint64_t begin {};
+		std::uint64_t end {};
+		std::uint64_t generation {};
+		std::uint64_t seek_frame {};
+	};
+
+	auto current_position() const -> std::uint64_t;
+	auto prefetch_loop() -> void;
+	auto publish(std::uint64_t begin, std::uint64_t end) -> void;
+	auto touch(std::uint64_t begin, std::uint64_t end) -> void;
+
+	Config config_;
+	detail::MappedFile file_;
+	detail::WavInfo info_;
+	SeqLock<Window> window_;
+	Window prefetch_window_ {};
+	std::uint64_t play_position_ {};
+	std::atomic<std::uint64_t> position_ {};
+	std::atomic<std::uint64_t> applied_generation_ {};
+	std::atomic<std::uint64_t> misses_ {};
+	std::atomic<bool> playing_ {};
+	std::atomic<bool> quit_ {};
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::atomic<std::uint64_t> seek_requested_ {};
+	std::uint64_t seek_target_ {};
+	std::uint64_t seek_done_ {};
+	std::thread prefetcher_;
+};
+
+inline FilePlayer::FilePlayer(Config config)
+	: config_ { std::move(config) }
+	, file_ { config_.path }
+	, info_ { detail::parse_wav(file_.data(), file_.size()) }
+{
+	prefetcher_ = std::thread([this]() { prefetch_loop(); });
+}
+
+inline FilePlayer::~FilePlayer()
+{
+	{
+		std::lock_guard lock { mutex_ };
+
+		quit_ = true;
+	}
+
+	cv_.notify_one();
+	prefetcher_.join();
+}
+
+inline auto FilePlayer::play() -> void
+{
+	playing_.store(true, std::memory_order_release);
+	cv_.notify_one();
+}
+
+inline auto FilePlayer::pause() -> void
+{
+	playing_.store(false, std::memory_order_release);
+}
+
+inline auto FilePlayer::seek(std::uint64_t frame, bool wait) -> void
+{
+	std::unique_lock lock { mutex_ };
+
+	const auto request { ++seek_requested_ };
+
+	seek_target_ = std::min(frame, frames());
+	cv_.notify_one();
+
+	if (!wait) return;
+
+	cv_.wait(lock, [this, request]() { return quit_ || seek_done_ >= request; });
+}
+
+inline auto FilePlayer::process(const Block& block) noexcept -> int
+{
+	const auto window { window_.load() };
+
+	if (window.generation != applied_generation_.load(std::memory_order_relaxed))
+	{
+		play_position_ = window.seek_frame;
+		position_.store(play_position_, std::memory_order_relaxed);
+		applied_generation_.store(window.generation, std::memory_order_release);
+	}
+
+	unsigned long done { 0 };
+
+	if (playing_.load(std::memory_order_acquire))
+	{
+		const auto available {
+			play_position_ >= window.begin && play_position_ < window.end
+				? std::min<std::uint64_t>(window.end - play_position_, block.frame_count)
+				: 0
+		};
+
+		const auto frame_bytes { info_.frame_bytes() };
+		const auto sample_bytes { frame_bytes / std::size_t(info_.channels) };
+		const auto src { file_.data() + info_.data_offset + (play_position_ * frame_bytes) };
+
+		for (std::size_t c { 0 }; c < block.output.size(); c++)
+		{
+			const auto file_channel { info_.channels == 1 ? 0 : c };
+
+			if (file_channel >= std::size_t(info_.channels)) continue;
+
+			const auto channel_src { src + (file_channel * sample_bytes) };
+			const auto dest { block.output[c] };
+
+			for (unsigned long f { 0 }; f < available; f++)
+			{
+				dest[f] = detail::read_sample(channel_src + (f * frame_bytes), info_.format);
+			}
+		}
+
+		done = static_cast<unsigned long>(available);
+
+		const auto wanted { std::min<std::uint64_t>(block.frame_count, frames() - std::min(play_position_, frames())) };
+
+		if (done < wanted) misses_.fetch_add(1, std::memory_order_relaxed);
+
+		// Keep going even through a miss so we stay in time
+		play_position_ = std::min(play_position_ + block.frame_count, frames());
+		position_.store(play_position_, std::memory_order_relaxed);
+	}
+
+	for (std::size_t c { 0 }; c < block.output.size(); c++)
+	{
+		const auto file_channel { info_.channels == 1 ? 0 : c };
+		const auto from { file_channel < std::size_t(info_.channels) ? done : 0 };
+
+		std::fill(block.output[c] + from, block.output[c] + block.frame_count, 0.0f);
+	}
+
+	return paContinue;
+}
+
+// Until the audio thread has jumped to the latest seek target, that's
+// where playback is as far as everyone else is concerned
+inline auto FilePlayer::current_position() const -> std::uint64_t
+{
+	const auto window { window_.load() };
+
+	if (applied_generation_.load(std::memory_order_acquire) != window.generation) return window.seek_frame;
+
+	return position_.load(std::memory_order_relaxed);
+}
+
+inline auto FilePlayer::publish(std::uint64_t begin, std::uint64_t end) -> void
+{
+	prefetch_window_.begin = begin;
+	prefetch_window_.end = end;
+	window_.store(prefetch_window_);
+}
+
+// Reads one byte from every page so they're faulted in here rather than
+// on the audio thread
+inline auto FilePlayer::touch(std::uint64_t begin, std::uint64_t end) -> void
+{
+	const auto frame_bytes { info_.frame_bytes() };
+	const auto offset { info_.data_offset + (begin * frame_bytes) };
+	const auto size { (end - begin) * frame_bytes };
+
+	file_.will_need(offset, size);
+
+	volatile std::byte sink {};
+
+	for (auto pos { offset / detail::MAP_PAGE_SIZE * detail::MAP_PAGE_SIZE }; pos < offset + size; pos += detail::MAP_PAGE_SIZE)
+	{
+		sink = file_.data()[pos];
+	}
+
+	sink = file_.data()[offset + size - 1];
+	static_cast<void>(sink);
+}
+
+inline auto FilePlayer::prefetch_loop() -> void
+{
+	const auto SR { double(std::max(info_.SR, 1)) };
+	const auto ahead { std::uint64_t(config_.prefetch_seconds * SR) };
+	const auto behind { std::uint64_t(config_.keep_behind_seconds * SR) };
+	const auto preroll { std::max(std::uint64_t(config_.seek_preroll_seconds * SR), std::uint64_t(1)) };
+
+	// Small enough that the audio thread can start using the first part
+	// of a long read-ahead while the rest is still coming in
+	const auto step { std::max(std::uint64_t((256 * 1024) / info_.frame_bytes()), std::uint64_t(1)) };
+
+	std::uint64_t handled_seek {};
+
+	for (;;)
+	{
+		std::uint64_t seek_target {};
+		std::uint64_t seek_request {};
+
+		{
+			std::unique_lock lock { mutex_ };
+
+			cv_.wait_for(lock, std::chrono::milliseconds(10), [this, handled_seek]() { return quit_ || seek_requested_ != handled_seek; });
+
+			if (quit_) return;
+
+			seek_target = seek_target_;
+			seek_request = seek_requested_;
+		}
+
+		if (seek_request != handled_seek)
+		{
+			const auto end { std::min(seek_target + preroll, frames()) };
+
+			if (end > seek_target) touch(seek_target, end);
+
+			prefetch_window_.generation = seek_request;
+			prefetch_window_.seek_frame = seek_target;
+			publish(seek_target, end);
+
+			handled_seek = seek_request;
+
+			// Let seek(wait = true) return
+			{
+				std::lock_guard lock { mutex_ };
+
+				seek_done_ = seek_request;
+			}
+
+			cv_.notify_all();
+			continue;
+		}
+
+		const auto position { current_position() };
+		const auto target_end { std::min(position + ahead, frames()) };
+
+		auto begin { prefetch_window_.begin };
+		auto end { prefetch_window_.end };
+
+		// Playback got outside the window somehow (e.g. a very long stall
+		// of this thread) so start again from where it is
+		if (position < begin || position > end)
+		{
+			begin = position;
+			end = position;
+			publish(begin, end);
+		}
+
+		// Shrink the window before releasing the pages, never after
+		if (position > begin + behind)
+		{
+			const auto new_begin { position - behind };
+			const auto frame_bytes { info_.frame_bytes() };
+
+			publish(new_begin, end);
+			file_.dont_need(info_.data_offset + (begin * frame_bytes), (new_begin - begin) * frame_bytes);
+
+			begin = new_begin;
+		}
+
+		while (end < target_end && !quit_ && seek_requested_ == handled_seek)
+		{
+			const auto next { std::min(end + step, target_end) };
+
+			touch(end, next);
+			publish(begin, next);
+
+			end = next;
+		}
+	}
+}
+
+} // pax
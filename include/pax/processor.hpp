@@ -0,0 +1,227 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <portaudio.h>
+#include "arena.hpp"
+#include "simd.hpp"
+
+namespace pax {
+
+inline constexpr std::size_t dynamic_channels { std::dynamic_extent };
+
+// Can be returned from process() instead of a PaStreamCallbackResult to
+// say there's nothing to do until the input makes a sound or the stream
+// is woken. The block's output is still used
+inline constexpr int process_idle { paAbort + 1 };
+
+struct StatusFlags
+{
+	PaStreamCallbackFlags bits {};
+
+	auto input_underflow() const -> bool { return bits & paInputUnderflow; }
+	auto input_overflow() const -> bool { return bits & paInputOverflow; }
+	auto output_underflow() const -> bool { return bits & paOutputUnderflow; }
+	auto output_overflow() const -> bool { return bits & paOutputOverflow; }
+	auto priming_output() const -> bool { return bits & paPrimingOutput; }
+	auto xrun() const -> bool { return bits & (paInputUnderflow | paInputOverflow | paOutputUnderflow | paOutputOverflow); }
+};
+
+struct Timing
+{
+	PaTime input_adc {};
+	PaTime current {};
+	PaTime output_dac {};
+
+	// Frames processed since the stream was started
+	std::uint64_t frame {};
+};
+
+// Planar views of one block of audio. Channel counts can be fixed at
+// compile time, in which case the spans have a static extent
+template <std::size_t InChannels = dynamic_channels, std::size_t OutChannels = dynamic_channels>
+struct BasicBlock
+{
+	std::span<const float* const, InChannels> input;
+	std::span<float* const, OutChannels> output;
+	unsigned long frame_count {};
+	Timing time {};
+	StatusFlags flags {};
+
+	// Temporary memory which is only valid until process() returns.
+	// nullptr unless Stream::Config::scratch_buffers was set
+	Arena* scratch {};
+};
+
+using Block = BasicBlock<>;
+
+// What the processor is about to be run with. frames_per_buffer is 0
+// if the host can deliver any number of frames per callback
+struct ProcessFormat
+{
+	double SR {};
+	unsigned long frames_per_buffer {};
+	unsigned long block_size {};
+	int input_channels {};
+	int output_channels {};
+};
+
+// A processor is any type with a process() member taking a BasicBlock.
+// It can optionally declare
+//
+//	static constexpr std::size_t input_channels { N };
+//	static constexpr std::size_t output_channels { N };
+//
+// to receive fixed-extent channel spans. process() can return void, a
+// PaStreamCallbackResult to end the stream, or process_idle.
+//
+// It can also have a prepare(const ProcessFormat&) member, which is called
+// on the control thread before the stream opens. That's the place to
+// allocate anything process() needs.
+//
+// While it's idle, a pending(const Block&) -> bool member is asked instead
+// of calling process(). Returning true wakes it up for that block.
+struct Processor
+{
+	void* object {};
+	auto (*process)(void* object, const Block& block) -> int {};
+	auto (*prepare)(void* object, const ProcessFormat& format) -> void {};
+	auto (*pending)(void* object, const Block& block) -> bool {};
+	std::size_t input_channels { dynamic_channels };
+	std::size_t output_channels { dynamic_channels };
+};
+
+namespace detail {
+
+template <class T>
+constexpr auto input_channels_of() -> std::size_t
+{
+	if constexpr (requires { T::input_channels; }) return T::input_channels;
+	else return dynamic_channels;
+}
+
+template <class T>
+constexpr auto output_channels_of() -> std::size_t
+{
+	if constexpr (requires { T::output_channels; }) return T::output_channels;
+	else return dynamic_channels;
+}
+
+template <std::size_t InChannels, std::size_t OutChannels>
+static inline auto block_cast(const Block& block) -> BasicBlock<InChannels, OutChannels>
+{
+	if constexpr (InChannels == dynamic_channels && OutChannels == dynamic_channels)
+	{
+		return block;
+	}
+	else
+	{
+		return
+		{
+			std::span<const float* const, InChannels> { block.input.data(), block.input.size() },
+			std::span<float* const, OutChannels> { block.output.data(), block.output.size() },
+			block.frame_count,
+			block.time,
+			block.flags,
+			block.scratch,
+		};
+	}
+}
+
+template <class T>
+static auto invoke_processor(void* object, const Block& block) -> int
+{
+	const auto processor { static_cast<T*>(object) };
+	const auto typed_block { block_cast<input_channels_of<T>(), output_channels_of<T>()>(block) };
+
+	if constexpr (std::is_void_v<decltype(processor->process(typed_block))>)
+	{
+		processor->process(typed_block);
+
+		return paContinue;
+	}
+	else
+	{
+		return processor->process(typed_block);
+	}
+}
+
+template <class T>
+static auto invoke_prepare(void* object, const ProcessFormat& format) -> void
+{
+	static_cast<T*>(object)->prepare(format);
+}
+
+template <class T>
+static auto invoke_pending(void* object, const Block& block) -> bool
+{
+	return static_cast<T*>(object)->pending(block);
+}
+
+// Combines the results of the process() calls making up one callback.
+// Ending the stream always wins, otherwise the last call decides whether
+// the processor is idle
+static inline auto combine_results(int result, int next) -> int
+{
+	if (result == paContinue || result == process_idle) return next;
+
+	return result;
+}
+
+static inline auto is_silent(std::span<const float* const> channels, unsigned long frame_count, float threshold) -> bool
+{
+	for (const auto channel : channels)
+	{
+		if (!simd::is_silent(channel, frame_count, threshold)) return false;
+	}
+
+	return true;
+}
+
+// Whether a processor which returned process_idle is left bypassed for
+// this block. Sound at the input, a wake() or the processor saying it
+// has something pending (e.g. a command which is due) brings it back.
+// The stream and replay::run() both decide it here so they agree
+static inline auto stay_idle(const Processor& processor, const Block& block, bool woken, float threshold) -> bool
+{
+	if (woken) return false;
+	if (!is_silent(block.input, block.frame_count, threshold)) return false;
+
+	return !(processor.pending && processor.pending(processor.object, block));
+}
+
+static inline auto channels_match(std::size_t expected, int actual) -> bool
+{
+	return expected == dynamic_channels || expected == std::size_t(actual);
+}
+
+} // detail
+
+template <class T>
+auto bind_processor(T* object) -> Processor
+{
+	Processor out;
+
+	out.object = object;
+	out.process = &detail::invoke_processor<T>;
+
+	if constexpr (requires (T& t, const ProcessFormat& format) { t.prepare(format); })
+	{
+		out.prepare = &detail::invoke_prepare<T>;
+	}
+
+	if constexpr (requires (T& t, const Block& block) { { t.pending(block) } -> std::convertible_to<bool>; })
+	{
+		out.pending = &detail::invoke_pending<T>;
+	}
+
+	out.input_channels = detail::input_channels_of<T>();
+	out.output_channels = detail::output_channels_of<T>();
+
+	return out;
+}
+
+} // pax
@@ -0,0 +1,620 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "buffer.hpp"
+#include "processor.hpp"
+#include "ring.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	define PAX_RECORDER_POSIX
+#endif
+
+namespace pax {
+
+// Streams a stream's input to disk. The audio thread only interleaves
+// each block into a lock-free ring; a writer thread drains the ring and
+// does all the file I/O in large aligned chunks, so a slow disk eats into
+// the ring rather than the callback. If the ring fills up anyway, whole
+// blocks are dropped and counted rather than blocking.
+//
+// Watch get_stats().peak_fill: if it creeps towards 1 the disk isn't
+// keeping up and the ring needs to be bigger (or the disk faster).
+//
+// Samples are written as native 32-bit float, so the files are only
+// valid WAV on little-endian machines.
+class Recorder
+{
+public:
+
+	enum class Format
+	{
+		WAV,  // Switches to RF64 when the data goes past 4GB
+		RF64,
+		Raw,  // Headerless interleaved float
+	};
+
+	struct Config
+	{
+		std::string path;
+		Format format { Format::WAV };
+		int channels {};
+		int SR {};
+
+		// Input channels [first_channel, first_channel + channels)
+		// are recorded. Missing channels are recorded as silence
+		int first_channel {};
+
+		// Bounds the memory used. This is how long the disk is allowed to
+		// stall for before audio is dropped
+		double ring_seconds { 4.0 };
+
+		// Size of each write. Rounded up to a multiple of DIRECT_IO_ALIGNMENT
+		std::size_t write_size { std::size_t(1) << 20 };
+
+		// Bypass the page cache (Linux O_DIRECT). Falls back to buffered
+		// writes if the filesystem doesn't support it
+		bool direct_io {};
+
+		// Reserve this many bytes up front (Linux fallocate) so the file
+		// system doesn't have to find space mid-recording. Any excess is
+		// released when recording stops
+		std::uint64_t preallocate {};
+	};
+
+	struct Stats
+	{
+		std::uint64_t frames_written {};
+		std::uint64_t frames_dropped {};
+		std::uint64_t overruns {};
+
+		// Fraction of the ring in use, now and at worst since starting
+		double fill {};
+		double peak_fill {};
+
+		// Peak fill has gone past RISK_FILL
+		bool at_risk {};
+		bool failed {};
+	};
+
+	static constexpr std::size_t DIRECT_IO_ALIGNMENT { 4096 };
+	static constexpr double RISK_FILL { 0.5 };
+
+	Recorder(Config config);
+	~Recorder();
+
+	Recorder(const Recorder&) = delete;
+	auto operator=(const Recorder&) -> Recorder& = delete;
+
+	// Control thread. start() opens the file and launches the writer and
+	// throws if the file can't be opened. stop() drains whatever is left
+	// in the ring, finalizes the header and throws if the writer failed
+	// along the way
+	auto start() -> void;
+	auto stop() -> void;
+	auto get_stats() const -> Stats;
+	auto recording() const -> bool { return running_.load(std::memory_order_acquire); }
+
+	// Audio thread
+	auto push(const Block& block) noexcept -> void;
+
+private:
+
+	auto write_loop() -> void;
+	auto drain(bool final) -> bool;
+
+	Config config_;
+	detail::SpscRing<float> ring_;
+	std::thread writer_;
+	std::atomic<bool> running_ {};
+	std::atomic<bool> stopping_ {};
+	std::atomic<bool> failed_ {};
+	std::string error_;
+	std::atomic<std::uint64_t> frames_written_ {};
+	std::atomic<std::uint64_t> frames_dropped_ {};
+	std::atomic<std::uint64_t> overruns_ {};
+	std::atomic<double> peak_fill_ {};
+
+	struct Output;
+
+	std::unique_ptr<Output> output_;
+};
+
+namespace detail {
+
+// Kept to a whole number of samples so the staging buffer fills up
+// exactly
+static constexpr std::size_t WAV_HEADER_SIZE { 92 };
+
+static_assert(WAV_HEADER_SIZE % sizeof(float) == 0);
+static constexpr auto RECORDER_POLL_INTERVAL { std::chrono::milliseconds(5) };
+
+struct AlignedByteDelete
+{
+	auto operator()(std::byte* ptr) const -> void
+	{
+		::operator delete[](ptr, std::align_val_t { Recorder::DIRECT_IO_ALIGNMENT });
+	}
+};
+
+static inline auto put_le(std::byte* dest, std::uint64_t value, int bytes) -> void
+{
+	for (int i { 0 }; i < bytes; i++)
+	{
+		dest[i] = std::byte((value >> (8 * i)) & 0xff);
+	}
+}
+
+static inline auto put_id(std::byte* dest, const char* id) -> void
+{
+	std::memcpy(dest, id, 4);
+}
+
+// RIFF/WAVE with a 28 byte JUNK chunk reserved up front. If the file ends
+// up too big for 32-bit sizes, the JUNK chunk becomes the ds64 chunk and
+// RIFF becomes RF64, without moving any audio
+static inline auto make_wav_header(bool rf64, int channels, int SR, std::uint64_t data_bytes) -> std::array<std::byte, WAV_HEADER_SIZE>
+{
+	std::array<std::byte, WAV_HEADER_SIZE> out {};
+
+	const auto h { out.data() };
+	const auto frame_bytes { std::uint64_t(channels) * sizeof(float) };
+	const auto frames { frame_bytes > 0 ? data_bytes / frame_bytes : 0 };
+	const auto riff_size { WAV_HEADER_SIZE - 8 + data_bytes };
+
+	put_id(h + 0, rf64 ? "RF64" : "RIFF");
+	put_le(h + 4, rf64 ? 0xffffffff : riff_size, 4);
+	put_id(h + 8, "WAVE");
+
+	put_id(h + 12, rf64 ? "ds64" : "JUNK");
+	put_le(h + 16, 28, 4);
+
+	if (rf64)
+	{
+		put_le(h + 20, riff_size, 8);
+		put_le(h + 28, data_bytes, 8);
+		put_le(h + 36, frames, 8);
+		put_le(h + 44, 0, 4);
+	}
+
+	// WAVE_FORMAT_IEEE_FLOAT
+	put_id(h + 48, "fmt ");
+	put_le(h + 52, 16, 4);
+	put_le(h + 56, 3, 2);
+	put_le(h + 58, std::uint64_t(channels), 2);
+	put_le(h + 60, std::uint64_t(SR), 4);
+	put_le(h + 64, std::uint64_t(SR) * frame_bytes, 4);
+	put_le(h + 68, frame_bytes, 2);
+	put_le(h + 70, 32, 2);
+
+	put_id(h + 72, "fact");
+	put_le(h + 76, 4, 4);
+	put_le(h + 80, rf64 ? 0xffffffff : frames, 4);
+
+	put_id(h + 84, "data");
+	put_le(h + 88, rf64 ? 0xffffffff : data_bytes, 4);
+
+	return out;
+}
+
+// Sequential writer which can optionally bypass the page cache. The
+// header is rewritten in place at the end through a separate buffered
+// handle, since by then the size is known
+class OutputFile
+{
+public:
+
+	~OutputFile() { close(); }
+
+	auto open(const std::string& path, bool direct_io, std::uint64_t preallocate) -> void;
+	auto direct() const -> bool { return direct_; }
+	auto write(const std::byte* data, std::size_t size) -> bool;
+	auto finish(std::uint64_t size, const std::byte* header, std::size_t header_size) -> bool;
+
+private:
+
+	auto close() -> void;
+
+	std::string path_;
+	bool direct_ {};
+#ifdef PAX_RECORDER_POSIX
+	int fd_ { -1 };
+#else
+	std::FILE* file_ {};
+#endif
+};
+
+#ifdef PAX_RECORDER_POSIX
+
+inline auto OutputFile::open(const std::string& path, bool direct_io, std::uint64_t preallocate) -> void
+{
+	close();
+
+	path_ = path;
+	direct_ = false;
+
+	const auto flags { O_WRONLY | O_CREAT | O_TRUNC };
+
+#	ifdef O_DIRECT
+	if (direct_io)
+	{
+		fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+		direct_ = fd_ >= 0;
+	}
+#	endif
+
+	if (fd_ < 0) fd_ = ::open(path.c_str(), flags, 0644);
+
+	if (fd_ < 0)
+	{
+		throw std::runtime_error("Couldn't open " + path + " for recording: " + std::strerror(errno));
+	}
+
+#	ifdef __linux__
+	// Best effort, not every file system supports it
+	if (preallocate > 0)
+	{
+		static_cast<void>(::fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, off_t(preallocate)));
+	}
+#	else
+	static_cast<void>(preallocate);
+#	endif
+}
+
+inline auto OutputFile::write(const std::byte* data, std::size_t size) -> bool
+{
+	while (size > 0)
+	{
+		const auto written { ::write(fd_, data, size) };
+
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+
+			return false;
+		}
+
+		data += written;
+		size -= std::size_t(written);
+	}
+
+	return true;
+}
+
+inline auto OutputFile::finish(std::uint64_t size, const std::byte* header, std::size_t header_size) -> bool
+{
+	close();
+
+	const auto fd { ::open(path_.c_str(), O_WRONLY) };
+
+	if (fd < 0) return false;
+
+	// Cuts off the padding of the last direct write and any preallocated
+	// space which wasn't used
+	auto ok { ::ftruncate(fd, off_t(size)) == 0 };
+
+	if (header_size > 0)
+	{
+		ok = ok && ::pwrite(fd, header, header_size, 0) == ssize_t(header_size);
+	}
+
+	return ::close(fd) == 0 && ok;
+}
+
+inline auto OutputFile::close() -> void
+{
+	if (fd_ < 0) return;
+
+	::close(fd_);
+
+	fd_ = -1;
+}
+
+#else
+
+inline auto OutputFile::open(const std::string& path, bool, std::uint64_t) -> void
+{
+	close();
+
+	path_ = path;
+	file_ = std::fopen(path.c_str(), "wb");
+
+	if (!file_)
+	{
+		throw std::runtime_error("Couldn't open " + path + " for recording");
+	}
+
+	// We already write in big chunks
+	std::setvbuf(file_, nullptr, _IONBF, 0);
+}
+
+inline auto OutputFile::write(const std::byte* data, std::size_t size) -> bool
+{
+	return std::fwrite(data, 1, size, file_) == size;
+}
+
+inline auto OutputFile::finish(std::uint64_t, const std::byte* header, std::size_t header_size) -> bool
+{
+	auto ok { true };
+
+	if (header_size > 0)
+	{
+		ok = std::fseek(file_, 0, SEEK_SET) == 0 && std::fwrite(header, 1, header_size, file_) == header_size;
+	}
+
+	ok = std::fclose(file_) == 0 && ok;
+	file_ = nullptr;
+
+	return ok;
+}
+
+inline auto OutputFile::close() -> void
+{
+	if (!file_) return;
+
+	std::fclose(file_);
+
+	file_ = nullptr;
+}
+
+#endif
+
+} // detail
+
+struct Recorder::Output
+{
+	detail::OutputFile file;
+	std::unique_ptr<std::byte[], detail::AlignedByteDelete> staging;
+	std::size_t staging_size {};
+	std::size_t staging_fill {};
+	std::uint64_t bytes_written {};
+};
+
+inline Recorder::Recorder(Config config)
+	: config_ { std::move(config) }
+{
+}
+
+inline Recorder::~Recorder()
+{
+	try
+	{
+		stop();
+	}
+	catch (...)
+	{
+	}
+}
+
+inline auto Recorder::start() -> void
+{
+	if (recording()) return;
+
+	// A writer which stopped because it failed still has to be joined
+	if (writer_.joinable())
+	{
+		writer_.join();
+		output_.reset();
+	}
+
+	if (config_.channels < 1 || config_.SR < 1)
+	{
+		throw std::invalid_argument("Recorder needs a channel count and sample rate");
+	}
+
+	const auto ring_frames { std::max(std::size_t(config_.ring_seconds * config_.SR), std::size_t(1024)) };
+
+	auto output { std::make_unique<Output>() };
+
+	output->file.open(config_.path, config_.direct_io, config_.preallocate);
+	output->staging_size = detail::align_up(std::max(config_.write_size, DIRECT_IO_ALIGNMENT), DIRECT_IO_ALIGNMENT);
+	output->staging.reset(new (std::align_val_t { DIRECT_IO_ALIGNMENT }) std::byte[output->staging_size]);
+
+	// The header goes out with the first chunk and gets patched at the end
+	if (config_.format != Format::Raw)
+	{
+		const auto header { detail::make_wav_header(config_.format == Format::RF64, config_.channels, config_.SR, 0) };
+
+		std::copy(header.begin(), header.end(), output->staging.get());
+
+		output->staging_fill = header.size();
+	}
+
+	ring_.reset(ring_frames * std::size_t(config_.channels));
+	output_ = std::move(output);
+	error_.clear();
+	failed_ = false;
+	stopping_ = false;
+	frames_written_ = 0;
+	frames_dropped_ = 0;
+	overruns_ = 0;
+	peak_fill_ = 0.0;
+	writer_ = std::thread([this]() { write_loop(); });
+	running_.store(true, std::memory_order_release);
+}
+
+inline auto Recorder::stop() -> void
+{
+	if (!writer_.joinable()) return;
+
+	running_.store(false, std::memory_order_release);
+	stopping_.store(true, std::memory_order_release);
+	writer_.join();
+	output_.reset();
+
+	if (failed_) throw std::runtime_error(error_);
+}
+
+inline auto Recorder::get_stats() const -> Stats
+{
+	Stats out;
+
+	const auto capacity { double(ring_.capacity()) };
+
+	out.frames_written = frames_written_.load(std::memory_order_relaxed);
+	out.frames_dropped = frames_dropped_.load(std::memory_order_relaxed);
+	out.overruns = overruns_.load(std::memory_order_relaxed);
+	out.fill = recording() ? double(ring_.read_available()) / capacity : 0.0;
+	out.peak_fill = peak_fill_.load(std::memory_order_relaxed);
+	out.at_risk = out.peak_fill >= RISK_FILL;
+	out.failed = failed_.load(std::memory_order_relaxed);
+
+	return out;
+}
+
+inline auto Recorder::push(const Block& block) noexcept -> void
+{
+	if (!running_.load(std::memory_order_acquire)) return;
+
+	const auto channels { std::size_t(config_.channels) };
+	const auto samples { block.frame_count * channels };
+	const auto regions { ring_.prepare_write(samples) };
+
+	// Dropping whole blocks keeps the file frame-aligned
+	if (regions.size() < samples)
+	{
+		frames_dropped_.fetch_add(block.frame_count, std::memory_order_relaxed);
+		overruns_.fetch_add(1, std::memory_order_relaxed);
+		peak_fill_.store(1.0, std::memory_order_relaxed);
+		return;
+	}
+
+	auto dest { regions.first };
+	auto dest_end { regions.first + regions.first_size };
+
+	for (unsigned long f { 0 }; f < block.frame_count; f++)
+	{
+		for (std::size_t c { 0 }; c < channels; c++)
+		{
+			if (dest == dest_end) dest = regions.second;
+
+			const auto source { std::size_t(config_.first_channel) + c };
+
+			*dest++ = source < block.input.size() ? block.input[source][f] : 0.0f;
+		}
+	}
+
+	ring_.commit_write(samples);
+
+	const auto fill { double(ring_.read_available()) / double(ring_.capacity()) };
+
+	// Only this thread writes it
+	if (fill > peak_fill_.load(std::memory_order_relaxed))
+	{
+		peak_fill_.store(fill, std::memory_order_relaxed);
+	}
+}
+
+inline auto Recorder::write_loop() -> void
+{
+	for (;;)
+	{
+		const auto stopping { stopping_.load(std::memory_order_acquire) };
+
+		if (!drain(false)) break;
+		if (stopping && ring_.read_available() == 0) break;
+		if (ring_.read_available() * sizeof(float) < output_->staging_size) std::this_thread::sleep_for(detail::RECORDER_POLL_INTERVAL);
+	}
+
+	if (failed_) return;
+
+	if (!drain(true))
+	{
+		return;
+	}
+
+	const auto data_bytes { output_->bytes_written - (config_.format == Format::Raw ? 0 : detail::WAV_HEADER_SIZE) };
+
+	auto ok { true };
+
+	if (config_.format == Format::Raw)
+	{
+		ok = output_->file.finish(output_->bytes_written, nullptr, 0);
+	}
+	else
+	{
+		const auto rf64 { config_.format == Format::RF64 || detail::WAV_HEADER_SIZE - 8 + data_bytes > 0xffffffff };
+		const auto header { detail::make_wav_header(rf64, config_.channels, config_.SR, data_bytes) };
+
+		ok = output_->file.finish(output_->bytes_written, header.data(), header.size());
+	}
+
+	if (!ok)
+	{
+		error_ = "Couldn't finalize recording " + config_.path;
+		failed_ = true;
+	}
+}
+
+// Moves samples from the ring into the staging buffer and writes every
+// chunk that fills up. With final set, also writes out the partial last
+// chunk, padded if the file was opened for direct I/O
+inline auto Recorder::drain(bool final) -> bool
+{
+	auto& out { *output_ };
+
+	const auto frame_bytes { std::size_t(config_.channels) * sizeof(float) };
+
+	for (;;)
+	{
+		const auto space { (out.staging_size - out.staging_fill) / sizeof(float) };
+		const auto regions { ring_.prepare_read(space) };
+
+		if (regions.size() > 0)
+		{
+			const auto dest { reinterpret_cast<float*>(out.staging.get() + out.staging_fill) };
+
+			std::memcpy(dest, regions.first, regions.first_size * sizeof(float));
+			std::memcpy(dest + regions.first_size, regions.second, regions.second_size * sizeof(float));
+			ring_.commit_read(regions.size());
+
+			out.staging_fill += regions.size() * sizeof(float);
+		}
+
+		const auto full { out.staging_fill == out.staging_size };
+
+		if (!full && !(final && out.staging_fill > 0)) return true;
+
+		auto write_size { out.staging_fill };
+
+		if (!full && out.file.direct())
+		{
+			write_size = detail::align_up(write_size, DIRECT_IO_ALIGNMENT);
+
+			std::fill(out.staging.get() + out.staging_fill, out.staging.get() + write_size, std::byte {});
+		}
+
+		if (!out.file.write(out.staging.get(), write_size))
+		{
+			error_ = "Write to " + config_.path + " failed";
+			failed_ = true;
+			running_.store(false, std::memory_order_release);
+			return false;
+		}
+
+		const auto header_bytes { config_.format != Format::Raw ? detail::WAV_HEADER_SIZE : 0 };
+
+		out.bytes_written += out.staging_fill;
+		out.staging_fill = 0;
+
+		frames_written_.store((out.bytes_written - header_bytes) / frame_bytes, std::memory_order_relaxed);
+
+		if (!full) return true;
+	}
+}
+
+} // pax
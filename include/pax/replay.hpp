@@ -0,0 +1,555 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "arena.hpp"
+#include "block_adapter.hpp"
+#include "buffer.hpp"
+#include "processor.hpp"
+#include "recorder.hpp"
+#include "ring.hpp"
+
+namespace pax {
+namespace replay {
+
+// Records exactly what the stream callback was given, to reproduce
+// driver behaviour offline: the input, the frame count, the time info
+// and the status flags of every callback, in order. Like Recorder, the
+// audio thread only copies into a lock-free ring and a writer thread does
+// the file I/O. Callbacks which don't fit are dropped and counted, and
+// the replay can see where (callback indices jump).
+//
+// Attach one to a running stream with Stream::set_capture(), after
+// starting it with the stream's format. Each record also says whether
+// the stream was armed and whether wake() had been called, so a replay
+// bypasses the processor in the same places.
+//
+// The file is a FileHeader followed by one RecordHeader plus planar
+// float input per callback, all in native byte order.
+class Capture
+{
+public:
+
+	struct Config
+	{
+		std::string path;
+
+		// How long the disk is allowed to stall for before callbacks are
+		// dropped
+		double ring_seconds { 4.0 };
+	};
+
+	struct Stats
+	{
+		std::uint64_t callbacks {};
+		std::uint64_t dropped {};
+		bool failed {};
+	};
+
+	Capture(Config config);
+	~Capture();
+
+	Capture(const Capture&) = delete;
+	auto operator=(const Capture&) -> Capture& = delete;
+
+	// Control thread. Both throw on file errors
+	auto start(const ProcessFormat& format) -> void;
+	auto stop() -> void;
+	auto get_stats() const -> Stats;
+	auto capturing() const -> bool { return running_.load(std::memory_order_acquire); }
+
+	// Audio thread. stream_flags are RECORD_* bits
+	auto push(const void* input, unsigned long frame_count, const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags status_flags, std::uint32_t stream_flags) noexcept -> void;
+
+private:
+
+	auto write_loop() -> void;
+	auto drain() -> bool;
+
+	Config config_;
+	int input_channels_ {};
+	std::uint64_t next_callback_ {};
+	pax::detail::SpscRing<std::byte> ring_;
+	pax::detail::OutputFile file_;
+	std::uint64_t bytes_written_ {};
+	std::thread writer_;
+	std::atomic<bool> running_ {};
+	std::atomic<bool> stopping_ {};
+	std::atomic<bool> failed_ {};
+	std::string error_;
+	std::atomic<std::uint64_t> callbacks_ {};
+	std::atomic<std::uint64_t> dropped_ {};
+};
+
+struct FileHeader
+{
+	char magic[4] { 'P', 'A', 'X', 'R' };
+	std::uint32_t version { 2 };
+	std::uint32_t input_channels {};
+	std::uint32_t output_channels {};
+	double SR {};
+	std::uint32_t frames_per_buffer {};
+	std::uint32_t block_size {};
+};
+
+// The stream played silence while armed
+inline constexpr std::uint32_t RECORD_ARMED { 1 };
+
+// wake() was called since the previous callback
+inline constexpr std::uint32_t RECORD_WOKEN { 2 };
+
+struct RecordHeader
+{
+	// Index of the callback since capture started
+	std::uint64_t callback {};
+	std::uint32_t frame_count {};
+	std::uint32_t status_flags {};
+	PaTime input_adc {};
+	PaTime current {};
+	PaTime output_dac {};
+	std::uint64_t stream_flags {};
+};
+
+struct Options
+{
+	// Wait between callbacks as long as the original stream did, rather
+	// than going as fast as possible
+	bool original_timing {};
+
+	// Compared with the hash of the processor's output
+	std::optional<std::uint64_t> expected_hash;
+
+	// Same as Stream::Config::scratch_buffers and silence_threshold
+	std::size_t scratch_buffers {};
+	float silence_threshold { 1.0e-5f };
+};
+
+struct Result
+{
+	std::uint64_t callbacks {};
+	std::uint64_t frames {};
+
+	// Places where the capture dropped callbacks
+	std::uint64_t gaps {};
+
+	// FNV-1a of every output sample, block by block and channel by
+	// channel within each block
+	std::uint64_t hash {};
+	bool matched { true };
+
+	// Wall clock time in the processor, for benchmarking
+	double process_seconds {};
+	double max_callback_seconds {};
+};
+
+namespace detail {
+
+static constexpr std::uint64_t FNV_OFFSET { 14695981039346656037ull };
+static constexpr std::uint64_t FNV_PRIME { 1099511628211ull };
+
+static inline auto fnv1a(std::uint64_t hash, const void* data, std::size_t size) -> std::uint64_t
+{
+	const auto bytes { static_cast<const unsigned char*>(data) };
+
+	for (std::size_t i { 0 }; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+// Sequential reader for capture files
+class Reader
+{
+public:
+
+	Reader(const std::string& path);
+	~Reader() { if (file_) std::fclose(file_); }
+
+	Reader(const Reader&) = delete;
+	auto operator=(const Reader&) -> Reader& = delete;
+
+	auto header() const -> const FileHeader& { return header_; }
+
+	// Input channels are resized to fit the record. False at the end
+	auto next(RecordHeader& record, std::vector<std::vector<float>>& input) -> bool;
+
+private:
+
+	std::FILE* file_ {};
+	std::string path_;
+	FileHeader header_;
+};
+
+inline Reader::Reader(const std::string& path)
+	: file_ { std::fopen(path.c_str(), "rb") }
+	, path_ { path }
+{
+	if (!file_)
+	{
+		throw std::runtime_error("Couldn't open " + path);
+	}
+
+	const FileHeader expected;
+
+	if (std::fread(&header_, sizeof(header_), 1, file_) != 1 || std::memcmp(header_.magic, expected.magic, 4) != 0)
+	{
+		throw std::runtime_error(path + " isn't a capture file");
+	}
+
+	if (header_.version != expected.version)
+	{
+		throw std::runtime_error(path + " was captured by a different version");
+	}
+}
+
+inline auto Reader::next(RecordHeader& record, std::vector<std::vector<float>>& input) -> bool
+{
+	if (std::fread(&record, sizeof(record), 1, file_) != 1) return false;
+
+	input.resize(header_.input_channels);
+
+	for (auto& channel : input)
+	{
+		channel.resize(std::max<std::size_t>(channel.size(), record.frame_count));
+
+		if (std::fread(channel.data(), sizeof(float), record.frame_count, file_) != record.frame_count)
+		{
+			throw std::runtime_error(path_ + " is truncated");
+		}
+	}
+
+	return true;
+}
+
+} // detail
+
+// Feeds a capture back through a processor the same way the stream
+// would have, including re-blocking if the stream used a fixed block
+// size, skipping it while the stream was armed and leaving it bypassed
+// while it's idle. The monitor and latency probe aren't replayed, and
+// a capture attached after the stream started begins with the
+// processor awake. Throws if the file can't be read
+inline auto run(const std::string& path, Processor processor, const Options& options = {}) -> Result;
+
+template <class T>
+auto run(const std::string& path, T* processor, const Options& options = {}) -> Result
+{
+	return run(path, bind_processor(processor), options);
+}
+
+inline Capture::Capture(Config config)
+	: config_ { std::move(config) }
+{
+}
+
+inline Capture::~Capture()
+{
+	try
+	{
+		stop();
+	}
+	catch (...)
+	{
+	}
+}
+
+inline auto Capture::start(const ProcessFormat& format) -> void
+{
+	if (capturing()) return;
+
+	// A writer which stopped because it failed still has to be joined
+	if (writer_.joinable()) writer_.join();
+
+	FileHeader header;
+
+	header.input_channels = std::uint32_t(format.input_channels);
+	header.output_channels = std::uint32_t(format.output_channels);
+	header.SR = format.SR;
+	header.frames_per_buffer = std::uint32_t(format.frames_per_buffer);
+	header.block_size = std::uint32_t(format.block_size);
+
+	file_.open(config_.path, false, 0);
+
+	if (!file_.write(reinterpret_cast<const std::byte*>(&header), sizeof(header)))
+	{
+		throw std::runtime_error("Write to " + config_.path + " failed");
+	}
+
+	bytes_written_ = sizeof(header);
+
+	// Allows for a record header every 32 frames, which is more than
+	// any real stream needs
+	const auto bytes_per_second { format.SR * ((format.input_channels * sizeof(float)) + (sizeof(RecordHeader) / 32.0)) };
+
+	ring_.reset(std::max(std::size_t(config_.ring_seconds * bytes_per_second), std::size_t(1) << 20));
+	input_channels_ = format.input_channels;
+	next_callback_ = 0;
+	error_.clear();
+	failed_ = false;
+	stopping_ = false;
+	callbacks_ = 0;
+	dropped_ = 0;
+	writer_ = std::thread([this]() { write_loop(); });
+	running_.store(true, std::memory_order_release);
+}
+
+inline auto Capture::stop() -> void
+{
+	if (!writer_.joinable()) return;
+
+	running_.store(false, std::memory_order_release);
+	stopping_.store(true, std::memory_order_release);
+	writer_.join();
+
+	if (failed_) throw std::runtime_error(error_);
+}
+
+inline auto Capture::get_stats() const -> Stats
+{
+	return { callbacks_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed), failed_.load(std::memory_order_relaxed) };
+}
+
+inline auto Capture::push(const void* input, unsigned long frame_count, const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags status_flags, std::uint32_t stream_flags) noexcept -> void
+{
+	if (!running_.load(std::memory_order_acquire)) return;
+
+	RecordHeader record;
+
+	record.callback = next_callback_++;
+	record.frame_count = std::uint32_t(frame_count);
+	record.status_flags = std::uint32_t(status_flags);
+	record.input_adc = time_info->inputBufferAdcTime;
+	record.current = time_info->currentTime;
+	record.output_dac = time_info->outputBufferDacTime;
+	record.stream_flags = stream_flags;
+
+	const auto channel_bytes { frame_count * sizeof(float) };
+	const auto size { sizeof(record) + (std::size_t(input_channels_) * channel_bytes) };
+
+	if (ring_.write_available() < size)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const auto channels { static_cast<const float* const*>(input) };
+
+	ring_.write(reinterpret_cast<const std::byte*>(&record), sizeof(record));
+
+	for (int c { 0 }; c < input_channels_; c++)
+	{
+		if (channels)
+		{
+			ring_.write(reinterpret_cast<const std::byte*>(channels[c]), channel_bytes);
+		}
+		else
+		{
+			// No input this time, e.g. priming the output
+			const auto regions { ring_.prepare_write(channel_bytes) };
+
+			std::fill(regions.first, regions.first + regions.first_size, std::byte {});
+			std::fill(regions.second, regions.second + regions.second_size, std::byte {});
+			ring_.commit_write(channel_bytes);
+		}
+	}
+
+	callbacks_.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline auto Capture::write_loop() -> void
+{
+	for (;;)
+	{
+		const auto stopping { stopping_.load(std::memory_order_acquire) };
+
+		if (!drain()) return;
+		if (stopping && ring_.read_available() == 0) break;
+
+		std::this_thread::sleep_for(pax::detail::RECORDER_POLL_INTERVAL);
+	}
+
+	if (!file_.finish(bytes_written_, nullptr, 0) && !failed_)
+	{
+		error_ = "Couldn't finalize capture " + config_.path;
+		failed_ = true;
+	}
+}
+
+// Writes the records straight out of the ring. They can be split across
+// the ring's end, which doesn't matter in a byte stream
+inline auto Capture::drain() -> bool
+{
+	const auto regions { ring_.prepare_read(ring_.read_available()) };
+
+	if (regions.size() < 1) return true;
+
+	if (!file_.write(regions.first, regions.first_size) || !file_.write(regions.second, regions.second_size))
+	{
+		error_ = "Write to " + config_.path + " failed";
+		failed_ = true;
+		running_.store(false, std::memory_order_release);
+		return false;
+	}
+
+	ring_.commit_read(regions.size());
+
+	bytes_written_ += regions.size();
+
+	return true;
+}
+
+inline auto run(const std::string& path, Processor processor, const Options& options) -> Result
+{
+	using Clock = std::chrono::steady_clock;
+
+	detail::Reader reader { path };
+
+	const auto& header { reader.header() };
+	const auto input_channels { int(header.input_channels) };
+	const auto output_channels { int(header.output_channels) };
+
+	if (!pax::detail::channels_match(processor.input_channels, input_channels) ||
+		!pax::detail::channels_match(processor.output_channels, output_channels))
+	{
+		throw std::runtime_error("Processor channel counts don't match the capture");
+	}
+
+	BlockAdapter adapter;
+
+	adapter.configure(header.block_size, header.frames_per_buffer, input_channels, output_channels, header.SR);
+
+	const auto block_frames { header.block_size > 0 ? header.block_size : header.frames_per_buffer > 0 ? header.frames_per_buffer : 4096u };
+
+	Arena scratch { pax::detail::planar_arena_size(options.scratch_buffers, std::size_t(std::max(input_channels, output_channels)), block_frames) };
+
+	if (processor.prepare)
+	{
+		processor.prepare(processor.object, { header.SR, header.frames_per_buffer, header.block_size, input_channels, output_channels });
+	}
+
+	Result out;
+
+	out.hash = detail::FNV_OFFSET;
+
+	RecordHeader record;
+	std::vector<std::vector<float>> input;
+	std::vector<const float*> input_ptrs(header.input_channels);
+	PlanarBuffer output;
+	std::optional<std::uint64_t> expected_callback;
+	std::optional<PaTime> first_time;
+	std::uint64_t frame { 0 };
+	bool idle { false };
+	bool woken { false };
+
+	const auto started { Clock::now() };
+
+	// Same as Stream::run()
+	const auto process = [&](const Block& block)
+	{
+		if (idle)
+		{
+			if (pax::detail::stay_idle(processor, block, woken, options.silence_threshold))
+			{
+				for (const auto channel : block.output)
+				{
+					std::fill(channel, channel + block.frame_count, 0.0f);
+				}
+
+				return process_idle;
+			}
+
+			woken = false;
+		}
+
+		const auto result { processor.process(processor.object, block) };
+
+		scratch.reset();
+		idle = result == process_idle;
+
+		return result;
+	};
+
+	while (reader.next(record, input))
+	{
+		if (expected_callback && record.callback != *expected_callback) out.gaps++;
+
+		expected_callback = record.callback + 1;
+
+		if (options.original_timing)
+		{
+			if (!first_time) first_time = record.current;
+
+			std::this_thread::sleep_until(started + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(record.current - *first_time)));
+		}
+
+		// Only grows, so nothing is allocated once the largest block has
+		// been seen
+		if (output.frames() < record.frame_count)
+		{
+			output = PlanarBuffer { std::size_t(output_channels), record.frame_count };
+		}
+
+		for (std::size_t c { 0 }; c < input.size(); c++)
+		{
+			input_ptrs[c] = input[c].data();
+		}
+
+		Block block;
+
+		block.input = { input_ptrs.data(), input_ptrs.size() };
+		block.output = { output.data(), output.channels() };
+		block.frame_count = record.frame_count;
+		block.time = { record.input_adc, record.current, record.output_dac, frame };
+		block.flags = { record.status_flags };
+		block.scratch = scratch.capacity() > 0 ? &scratch : nullptr;
+
+		const auto begin { Clock::now() };
+
+		woken = woken || (record.stream_flags & RECORD_WOKEN);
+
+		if (record.stream_flags & RECORD_ARMED)
+		{
+			output.clear();
+		}
+		else
+		{
+			if (adapter.enabled()) adapter.process(block, process);
+			else process(block);
+
+			frame += record.frame_count;
+		}
+
+		const auto seconds { std::chrono::duration<double>(Clock::now() - begin).count() };
+
+		out.process_seconds += seconds;
+		out.max_callback_seconds = std::max(out.max_callback_seconds, seconds);
+
+		for (std::size_t c { 0 }; c < output.channels(); c++)
+		{
+			out.hash = detail::fnv1a(out.hash, output.channel(c), record.frame_count * sizeof(float));
+		}
+
+		out.frames += record.frame_count;
+		out.callbacks++;
+	}
+
+	out.matched = !options.expected_hash || *options.expected_hash == out.hash;
+
+	return out;
+}
+
+} // replay
+} // pax
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace pax {
+namespace detail {
+
+// Single-producer single-consumer ring of trivially copyable elements.
+// Capacity is rounded up to a power of two. Producer and consumer can
+// access the free/used space in place as up to two contiguous regions,
+// so nothing has to be staged through a temporary buffer
+template <class T>
+class SpscRing
+{
+public:
+
+	struct Regions
+	{
+		T* first {};
+		std::size_t first_size {};
+		T* second {};
+		std::size_t second_size {};
+
+		auto size() const -> std::size_t { return first_size + second_size; }
+	};
+
+	SpscRing() = default;
+	SpscRing(std::size_t capacity) { reset(capacity); }
+
+	// Not thread safe. Only call this while nothing is using the ring
+	auto reset(std::size_t capacity) -> void;
+
+	auto capacity() const -> std::size_t { return mask_ + 1; }
+	auto read_available() const -> std::size_t;
+	auto write_available() const -> std::size_t;
+
+	// Producer
+	auto prepare_write(std::size_t count) -> Regions;
+	auto commit_write(std::size_t count) -> void;
+	auto write(const T* data, std::size_t count) -> std::size_t;
+
+	// Consumer
+	auto prepare_read(std::size_t count) -> Regions;
+	auto commit_read(std::size_t count) -> void;
+	auto read(T* data, std::size_t count) -> std::size_t;
+
+private:
+
+	auto regions(std::size_t start, std::size_t count) -> Regions;
+
+	std::size_t mask_ {};
+	std::unique_ptr<T[]> data_;
+	alignas(64) std::atomic<std::size_t> write_ {};
+	alignas(64) std::atomic<std::size_t> read_ {};
+};
+
+template <class T>
+auto SpscRing<T>::reset(std::size_t capacity) -> void
+{
+	std::size_t size { 1 };
+
+	while (size < capacity) size <<= 1;
+
+	mask_ = size - 1;
+	data_ = std::make_unique<T[]>(size);
+	write_.store(0, std::memory_order_relaxed);
+	read_.store(0, std::memory_order_relaxed);
+}
+
+template <class T>
+auto SpscRing<T>::read_available() const -> std::size_t
+{
+	return write_.load(std::memory_order_acquire) - read_.load(std::memory_order_acquire);
+}
+
+template <class T>
+auto SpscRing<T>::write_available() const -> std::size_t
+{
+	return capacity() - read_available();
+}
+
+template <class T>
+auto SpscRing<T>::regions(std::size_t start, std::size_t count) -> Regions
+{
+	Regions out;
+
+	const auto offset { start & mask_ };
+	const auto first { std::min(count, capacity() - offset) };
+
+	out.first = data_.get() + offset;
+	out.first_size = first;
+	out.second = data_.get();
+	out.second_size = count - first;
+
+	return out;
+}
+
+template <class T>
+auto SpscRing<T>::prepare_write(std::size_t count) -> Regions
+{
+	return regions(write_.load(std::memory_order_relaxed), std::min(count, write_available()));
+}
+
+template <class T>
+auto SpscRing<T>::commit_write(std::size_t count) -> void
+{
+	write_.store(write_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+template <class T>
+auto SpscRing<T>::write(const T* data, std::size_t count) -> std::size_t
+{
+	const auto regions { prepare_write(count) };
+
+	std::copy_n(data, regions.first_size, regions.first);
+	std::copy_n(data + regions.first_size, regions.second_size, regions.second);
+	commit_write(regions.size());
+
+	return regions.size();
+}
+
+template <class T>
+auto SpscRing<T>::prepare_read(std::size_t count) -> Regions
+{
+	return regions(read_.load(std::memory_order_relaxed), std::min(count, read_available()));
+}
+
+template <class T>
+auto SpscRing<T>::commit_read(std::size_t count) -> void
+{
+	read_.store(read_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+template <class T>
+auto SpscRing<T>::read(T* data, std::size_t count) -> std::size_t
+{
+	const auto regions { prepare_read(count) };
+
+	std::copy_n(regions.first, regions.first_size, data);
+	std::copy_n(regions.second, regions.second_size, data + regions.first_size);
+	commit_read(regions.size());
+
+	return regions.size();
+}
+
+} // detail
+} // pax
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PAX_RT_SSE 1
+#endif
+
+#ifdef __linux__
+#include <alloca.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace pax {
+namespace rt {
+
+// Opt-in fixes applied to the audio callback thread. Everything here is
+// either cheap or only happens once per stream, so it's safe to turn on
+// by default in clients that care about glitches
+struct Hygiene
+{
+	bool enabled { false };
+
+	// Set flush-to-zero and denormals-are-zero on the callback thread
+	bool flush_denormals { true };
+
+	// CPUs to pin the callback thread to. Empty means leave it alone
+	std::vector<int> cpus {};
+
+	// Raise the callback thread to SCHED_FIFO at this priority, if the
+	// process is allowed to
+	std::optional<int> fifo_priority {};
+
+	// mlockall() and prefault this much stack and heap so the callback
+	// doesn't page fault the first time it touches memory
+	bool lock_memory { false };
+	std::size_t stack_prefault { 64 * 1024 };
+	std::size_t heap_reserve { 0 };
+};
+
+// What actually succeeded for the current stream
+struct Report
+{
+	bool applied {};
+	bool flush_denormals {};
+	bool affinity {};
+	bool fifo {};
+	bool memory_locked {};
+	std::size_t stack_prefaulted {};
+	std::size_t heap_reserved {};
+};
+
+namespace detail {
+
+enum : unsigned
+{
+	APPLIED         = 1 << 0,
+	FLUSH_DENORMALS = 1 << 1,
+	AFFINITY        = 1 << 2,
+	FIFO            = 1 << 3,
+	MEMORY_LOCKED   = 1 << 4,
+};
+
+static inline auto set_flush_denormals() -> bool
+{
+#if defined(PAX_RT_SSE)
+	// FTZ (bit 15) | DAZ (bit 6)
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+	return true;
+#elif defined(__aarch64__)
+	std::uint64_t fpcr;
+	asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+	asm volatile("msr fpcr, %0" :: "r"(fpcr | (std::uint64_t(1) << 24)));
+	return true;
+#else
+	return false;
+#endif
+}
+
+static inline auto set_affinity(const std::vector<int>& cpus) -> bool
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+
+	for (const auto cpu : cpus)
+	{
+		CPU_SET(cpu, &set);
+	}
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
+
+static inline auto set_fifo(int priority) -> bool
+{
+#ifdef __linux__
+	sched_param param {};
+
+	param.sched_priority = priority;
+
+	return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#else
+	(void)priority;
+	return false;
+#endif
+}
+
+static inline auto prefault_stack(std::size_t size) -> std::size_t
+{
+#ifdef __linux__
+	if (size < 1) return 0;
+
+	const auto stack { static_cast<volatile char*>(alloca(size)) };
+
+	for (std::size_t i { 0 }; i < size; i += 4096)
+	{
+		stack[i] = 0;
+	}
+
+	return size;
+#else
+	(void)size;
+	return 0;
+#endif
+}
+
+static inline auto lock_memory() -> bool
+{
+#ifdef __linux__
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#else
+	return false;
+#endif
+}
+
+static inline auto reserve_heap(std::size_t size) -> std::size_t
+{
+#ifdef __linux__
+	if (size < 1) return 0;
+
+	// Stop glibc from handing the memory back to the OS or serving
+	// large requests with fresh mmaps, otherwise the reserve is gone
+	// as soon as we free it
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	const auto block { static_cast<char*>(std::malloc(size)) };
+
+	if (!block) return 0;
+
+	for (std::size_t i { 0 }; i < size; i += 4096)
+	{
+		static_cast<volatile char*>(block)[i] = 0;
+	}
+
+	std::free(block);
+
+	return size;
+#else
+	(void)size;
+	return 0;
+#endif
+}
+
+class Hygienist
+{
+public:
+
+	// Called from the control thread before each new stream is opened
+	auto configure(const Hygiene& hygiene) -> void;
+
+	// Called from the audio thread at the top of every callback
+	auto on_callback() -> void;
+
+	auto report() const -> Report;
+
+private:
+
+	auto apply_thread() -> void;
+
+	Hygiene hygiene_;
+	std::atomic<bool> pending_ {};
+	std::atomic<unsigned> applied_ {};
+	std::atomic<std::size_t> stack_prefaulted_ {};
+	std::atomic<std::size_t> heap_reserved_ {};
+};
+
+inline auto Hygienist::configure(const Hygiene& hygiene) -> void
+{
+	hygiene_ = hygiene;
+	applied_ = 0;
+	stack_prefaulted_ = 0;
+	heap_reserved_ = 0;
+
+	if (!hygiene_.enabled)
+	{
+		pending_ = false;
+		return;
+	}
+
+	// Process-wide steps are done here rather than on the audio thread
+	if (hygiene_.lock_memory)
+	{
+		if (lock_memory()) applied_ |= MEMORY_LOCKED;
+
+		heap_reserved_ = reserve_heap(hygiene_.heap_reserve);
+	}
+
+	pending_.store(true, std::memory_order_release);
+}
+
+inline auto Hygienist::on_callback() -> void
+{
+	if (!pending_.load(std::memory_order_acquire)) return;
+
+	apply_thread();
+	pending_.store(false, std::memory_order_relaxed);
+}
+
+inline auto Hygienist::apply_thread() -> void
+{
+	unsigned applied { APPLIED };
+
+	if (hygiene_.flush_denormals && set_flush_denormals()) applied |= FLUSH_DENORMALS;
+	if (!hygiene_.cpus.empty() && set_affinity(hygiene_.cpus)) applied |= AFFINITY;
+	if (hygiene_.fifo_priority && set_fifo(*hygiene_.fifo_priority)) applied |= FIFO;
+
+	if (hygiene_.lock_memory)
+	{
+		stack_prefaulted_.store(prefault_stack(hygiene_.stack_prefault), std::memory_order_relaxed);
+	}
+
+	applied_.fetch_or(applied, std::memory_order_release);
+}
+
+inline auto Hygienist::report() const -> Report
+{
+	Report out;
+
+	const auto applied { applied_.load(std::memory_order_acquire) };
+
+	out.applied = applied & APPLIED;
+	out.flush_denormals = applied & FLUSH_DENORMALS;
+	out.affinity = applied & AFFINITY;
+	out.fifo = applied & FIFO;
+	out.memory_locked = applied & MEMORY_LOCKED;
+	out.stack_prefaulted = stack_prefaulted_.load(std::memory_order_relaxed);
+	out.heap_reserved = heap_reserved_.load(std::memory_order_relaxed);
+
+	return out;
+}
+
+} // detail
+} // rt
+} // pax
@@ -0,0 +1,472 @@
+#pragma once
+
+// Debug instrumentation which flags heap allocations, mutex locks and
+// blocking calls made on the audio thread while Stream::callback is
+// running.
+//
+// Build with PAX_RT_CHECK defined everywhere pax is included, and define
+// PAX_RT_CHECK_IMPLEMENTATION in exactly one translation unit before
+// including this header to emit the operator new/delete replacements
+// and (on glibc) the malloc, pthread and syscall interposers. On glibc
+// the interposers look up the real functions with dlsym(RTLD_NEXT), so
+// link with -ldl on older toolchains.
+//
+// The per-call cost outside the callback is a thread_local check, so
+// it's fine to leave on in QA builds.
+
+#ifdef PAX_RT_CHECK
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <vector>
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define PAX_RT_CHECK_BACKTRACE 1
+#endif
+
+namespace pax {
+namespace rt {
+namespace check {
+
+enum class Kind
+{
+	Allocation,
+	Deallocation,
+	Lock,
+	Blocking,
+};
+
+constexpr std::size_t KIND_COUNT { 4 };
+constexpr std::size_t MAX_STACK_DEPTH { 24 };
+constexpr std::size_t MAX_VIOLATIONS { 256 };
+
+struct Violation
+{
+	Kind kind;
+	const char* what;
+	std::uint64_t callback;
+	int depth;
+	std::array<void*, MAX_STACK_DEPTH> stack;
+};
+
+struct Report
+{
+	std::uint64_t callbacks {};
+	std::array<std::uint64_t, KIND_COUNT> counts {};
+
+	// Violations which were counted but didn't fit in the capture buffer
+	std::uint64_t dropped {};
+
+	std::vector<Violation> violations;
+};
+
+// Marks the current thread as realtime for the lifetime of the scope
+class Scope
+{
+public:
+
+	Scope();
+	~Scope();
+
+	Scope(const Scope&) = delete;
+	auto operator=(const Scope&) -> Scope& = delete;
+};
+
+auto is_marked() -> bool;
+auto on_violation(Kind kind, const char* what) -> void;
+auto report() -> Report;
+auto reset() -> void;
+auto to_string(Kind kind) -> const char*;
+auto write_report(std::ostream& os, const Report& report) -> void;
+
+namespace detail {
+
+struct State
+{
+	std::atomic<std::uint64_t> callbacks {};
+	std::array<std::atomic<std::uint64_t>, KIND_COUNT> counts {};
+	std::atomic<std::uint64_t> dropped {};
+	std::atomic<std::size_t> next {};
+	std::array<Violation, MAX_VIOLATIONS> violations {};
+	std::array<std::atomic<bool>, MAX_VIOLATIONS> ready {};
+};
+
+inline State state;
+inline thread_local int marked {};
+inline thread_local bool capturing {};
+inline thread_local std::uint64_t current_callback {};
+
+} // detail
+
+inline Scope::Scope()
+{
+	if (detail::marked++ == 0)
+	{
+		detail::current_callback = detail::state.callbacks.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+inline Scope::~Scope()
+{
+	detail::marked--;
+}
+
+inline auto is_marked() -> bool
+{
+	return detail::marked > 0 && !detail::capturing;
+}
+
+inline auto on_violation(Kind kind, const char* what) -> void
+{
+	if (!is_marked()) return;
+
+	// Anything the capture itself does (e.g. backtrace() allocating on
+	// first use) must not be reported
+	detail::capturing = true;
+
+	auto& state { detail::state };
+
+	state.counts[size_t(kind)].fetch_add(1, std::memory_order_relaxed);
+
+	const auto slot { state.next.fetch_add(1, std::memory_order_relaxed) };
+
+	if (slot < MAX_VIOLATIONS)
+	{
+		auto& violation { state.violations[slot] };
+
+		violation.kind = kind;
+		violation.what = what;
+		violation.callback = detail::current_callback;
+#ifdef PAX_RT_CHECK_BACKTRACE
+		violation.depth = backtrace(violation.stack.data(), int(MAX_STACK_DEPTH));
+#else
+		violation.depth = 0;
+#endif
+		state.ready[slot].store(true, std::memory_order_release);
+	}
+	else
+	{
+		state.dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	detail::capturing = false;
+}
+
+inline auto report() -> Report
+{
+	Report out;
+
+	auto& state { detail::state };
+
+	out.callbacks = state.callbacks.load(std::memory_order_relaxed);
+	out.dropped = state.dropped.load(std::memory_order_relaxed);
+
+	for (std::size_t i { 0 }; i < KIND_COUNT; i++)
+	{
+		out.counts[i] = state.counts[i].load(std::memory_order_relaxed);
+	}
+
+	const auto captured { std::min(state.next.load(std::memory_order_relaxed), MAX_VIOLATIONS) };
+
+	for (std::size_t i { 0 }; i < captured; i++)
+	{
+		if (!state.ready[i].load(std::memory_order_acquire)) continue;
+
+		out.violations.push_back(state.violations[i]);
+	}
+
+	return out;
+}
+
+// Only call this while no stream is running
+inline auto reset() -> void
+{
+	auto& state { detail::state };
+
+	state.callbacks = 0;
+	state.dropped = 0;
+	state.next = 0;
+
+	for (auto& count : state.counts) count = 0;
+	for (auto& ready : state.ready) ready = false;
+}
+
+inline auto to_string(Kind kind) -> const char*
+{
+	switch (kind)
+	{
+		case Kind::Allocation: return "allocation";
+		case Kind::Deallocation: return "deallocation";
+		case Kind::Lock: return "lock";
+		case Kind::Blocking: return "blocking call";
+	}
+
+	return "unknown";
+}
+
+inline auto write_report(std::ostream& os, const Report& report) -> void
+{
+	os << "pax realtime check: " << report.callbacks << " callbacks\n";
+
+	for (std::size_t i { 0 }; i < KIND_COUNT; i++)
+	{
+		os << "  " << to_string(Kind(i)) << ": " << report.counts[i] << "\n";
+	}
+
+	if (report.dropped > 0)
+	{
+		os << "  (" << report.dropped << " violations not captured)\n";
+	}
+
+	for (const auto& violation : report.violations)
+	{
+		os << "\n" << to_string(violation.kind) << " '" << violation.what << "' in callback " << violation.callback << "\n";
+
+#ifdef PAX_RT_CHECK_BACKTRACE
+		const auto symbols { backtrace_symbols(violation.stack.data(), violation.depth) };
+
+		if (!symbols) continue;
+
+		for (int i { 0 }; i < violation.depth; i++)
+		{
+			os << "    " << symbols[i] << "\n";
+		}
+
+		std::free(symbols);
+#endif
+	}
+}
+
+} // check
+} // rt
+} // pax
+
+#ifdef PAX_RT_CHECK_IMPLEMENTATION
+
+#include <new>
+
+#if defined(__GLIBC__)
+#include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace pax {
+namespace rt {
+namespace check {
+namespace detail {
+
+#if defined(__GLIBC__)
+
+extern "C" void* __libc_malloc(std::size_t size) noexcept;
+extern "C" void* __libc_calloc(std::size_t count, std::size_t size) noexcept;
+extern "C" void* __libc_realloc(void* ptr, std::size_t size) noexcept;
+extern "C" void* __libc_memalign(std::size_t alignment, std::size_t size) noexcept;
+extern "C" void __libc_free(void* ptr) noexcept;
+
+static inline auto raw_malloc(std::size_t size) -> void* { return __libc_malloc(size); }
+static inline auto raw_aligned_malloc(std::size_t alignment, std::size_t size) -> void* { return __libc_memalign(alignment, size); }
+static inline auto raw_free(void* ptr) -> void { __libc_free(ptr); }
+static inline auto raw_aligned_free(void* ptr) -> void { __libc_free(ptr); }
+
+// Resolved lazily into a constant-initialized cache rather than a
+// function-local static with a dynamic initializer, because the static's
+// guard could itself end up in pthread_mutex_lock
+template <class F>
+static inline auto next(std::atomic<void*>& cache, const char* name) -> F
+{
+	auto out { cache.load(std::memory_order_relaxed) };
+
+	if (!out)
+	{
+		out = dlsym(RTLD_NEXT, name);
+		cache.store(out, std::memory_order_relaxed);
+	}
+
+	return reinterpret_cast<F>(out);
+}
+
+#elif defined(_WIN32)
+
+static inline auto raw_malloc(std::size_t size) -> void* { return std::malloc(size); }
+static inline auto raw_aligned_malloc(std::size_t alignment, std::size_t size) -> void* { return _aligned_malloc(size, alignment); }
+static inline auto raw_free(void* ptr) -> void { std::free(ptr); }
+static inline auto raw_aligned_free(void* ptr) -> void { _aligned_free(ptr); }
+
+#else
+
+static inline auto raw_malloc(std::size_t size) -> void* { return std::malloc(size); }
+static inline auto raw_aligned_malloc(std::size_t alignment, std::size_t size) -> void* { return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment); }
+static inline auto raw_free(void* ptr) -> void { std::free(ptr); }
+static inline auto raw_aligned_free(void* ptr) -> void { std::free(ptr); }
+
+#endif
+
+static inline auto allocate(std::size_t size, const char* what) -> void*
+{
+	if (marked) on_violation(Kind::Allocation, what);
+
+	return raw_malloc(size ? size : 1);
+}
+
+static inline auto allocate_aligned(std::size_t size, std::align_val_t alignment, const char* what) -> void*
+{
+	if (marked) on_violation(Kind::Allocation, what);
+
+	return raw_aligned_malloc(std::size_t(alignment), size ? size : 1);
+}
+
+static inline auto deallocate(void* ptr, const char* what) -> void
+{
+	if (!ptr) return;
+	if (marked) on_violation(Kind::Deallocation, what);
+
+	raw_free(ptr);
+}
+
+static inline auto deallocate_aligned(void* ptr, const char* what) -> void
+{
+	if (!ptr) return;
+	if (marked) on_violation(Kind::Deallocation, what);
+
+	raw_aligned_free(ptr);
+}
+
+// Make sure backtrace() has already loaded its unwinder before the first
+// capture happens on the audio thread
+static const struct BacktracePrimer
+{
+	BacktracePrimer()
+	{
+#ifdef PAX_RT_CHECK_BACKTRACE
+		void* frame;
+		backtrace(&frame, 1);
+#endif
+	}
+} backtrace_primer;
+
+} // detail
+} // check
+} // rt
+} // pax
+
+auto operator new(std::size_t size) -> void*
+{
+	if (const auto out { pax::rt::check::detail::allocate(size, "operator new") }) return out;
+
+	throw std::bad_alloc {};
+}
+
+auto operator new[](std::size_t size) -> void*
+{
+	if (const auto out { pax::rt::check::detail::allocate(size, "operator new[]") }) return out;
+
+	throw std::bad_alloc {};
+}
+
+auto operator new(std::size_t size, const std::nothrow_t&) noexcept -> void*
+{
+	return pax::rt::check::detail::allocate(size, "operator new");
+}
+
+auto operator new[](std::size_t size, const std::nothrow_t&) noexcept -> void*
+{
+	return pax::rt::check::detail::allocate(size, "operator new[]");
+}
+
+auto operator new(std::size_t size, std::align_val_t alignment) -> void*
+{
+	if (const auto out { pax::rt::check::detail::allocate_aligned(size, alignment, "operator new") }) return out;
+
+	throw std::bad_alloc {};
+}
+
+auto operator new[](std::size_t size, std::align_val_t alignment) -> void*
+{
+	if (const auto out { pax::rt::check::detail::allocate_aligned(size, alignment, "operator new[]") }) return out;
+
+	throw std::bad_alloc {};
+}
+
+auto operator delete(void* ptr) noexcept -> void { pax::rt::check::detail::deallocate(ptr, "operator delete"); }
+auto operator delete[](void* ptr) noexcept -> void { pax::rt::check::detail::deallocate(ptr, "operator delete[]"); }
+auto operator delete(void* ptr, std::size_t) noexcept -> void { pax::rt::check::detail::deallocate(ptr, "operator delete"); }
+auto operator delete[](void* ptr, std::size_t) noexcept -> void { pax::rt::check::detail::deallocate(ptr, "operator delete[]"); }
+auto operator delete(void* ptr, std::align_val_t) noexcept -> void { pax::rt::check::detail::deallocate_aligned(ptr, "operator delete"); }
+auto operator delete[](void* ptr, std::align_val_t) noexcept -> void { pax::rt::check::detail::deallocate_aligned(ptr, "operator delete[]"); }
+auto operator delete(void* ptr, std::size_t, std::align_val_t) noexcept -> void { pax::rt::check::detail::deallocate_aligned(ptr, "operator delete"); }
+auto operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept -> void { pax::rt::check::detail::deallocate_aligned(ptr, "operator delete[]"); }
+
+#if defined(__GLIBC__)
+
+extern "C" {
+
+auto malloc(std::size_t size) noexcept -> void*
+{
+	if (pax::rt::check::detail::marked) pax::rt::check::on_violation(pax::rt::check::Kind::Allocation, "malloc");
+
+	return pax::rt::check::detail::__libc_malloc(size);
+}
+
+auto calloc(std::size_t count, std::size_t size) noexcept -> void*
+{
+	if (pax::rt::check::detail::marked) pax::rt::check::on_violation(pax::rt::check::Kind::Allocation, "calloc");
+
+	return pax::rt::check::detail::__libc_calloc(count, size);
+}
+
+auto realloc(void* ptr, std::size_t size) noexcept -> void*
+{
+	if (pax::rt::check::detail::marked) pax::rt::check::on_violation(pax::rt::check::Kind::Allocation, "realloc");
+
+	return pax::rt::check::detail::__libc_realloc(ptr, size);
+}
+
+auto free(void* ptr) noexcept -> void
+{
+	if (ptr && pax::rt::check::detail::marked) pax::rt::check::on_violation(pax::rt::check::Kind::Deallocation, "free");
+
+	pax::rt::check::detail::__libc_free(ptr);
+}
+
+#define PAX_RT_CHECK_INTERPOSE(kind, name, ret, params, args, ...)                                 \
+	auto name params __VA_ARGS__ -> ret                                                            \
+	{                                                                                              \
+		static std::atomic<void*> real {};                                                          \
+		if (pax::rt::check::detail::marked) pax::rt::check::on_violation(pax::rt::check::Kind::kind, #name); \
+		return pax::rt::check::detail::next<decltype(&::name)>(real, #name) args;                  \
+	}
+
+PAX_RT_CHECK_INTERPOSE(Lock, pthread_mutex_lock, int, (pthread_mutex_t* mutex), (mutex), noexcept)
+PAX_RT_CHECK_INTERPOSE(Lock, pthread_rwlock_rdlock, int, (pthread_rwlock_t* lock), (lock), noexcept)
+PAX_RT_CHECK_INTERPOSE(Lock, pthread_rwlock_wrlock, int, (pthread_rwlock_t* lock), (lock), noexcept)
+PAX_RT_CHECK_INTERPOSE(Blocking, pthread_cond_wait, int, (pthread_cond_t* cond, pthread_mutex_t* mutex), (cond, mutex))
+PAX_RT_CHECK_INTERPOSE(Blocking, pthread_cond_timedwait, int, (pthread_cond_t* cond, pthread_mutex_t* mutex, const timespec* abstime), (cond, mutex, abstime))
+PAX_RT_CHECK_INTERPOSE(Blocking, pthread_join, int, (pthread_t thread, void** result), (thread, result))
+PAX_RT_CHECK_INTERPOSE(Blocking, sem_wait, int, (sem_t* sem), (sem))
+PAX_RT_CHECK_INTERPOSE(Blocking, nanosleep, int, (const timespec* duration, timespec* remaining), (duration, remaining))
+PAX_RT_CHECK_INTERPOSE(Blocking, clock_nanosleep, int, (clockid_t clock, int flags, const timespec* t, timespec* remaining), (clock, flags, t, remaining))
+PAX_RT_CHECK_INTERPOSE(Blocking, usleep, int, (useconds_t usec), (usec))
+PAX_RT_CHECK_INTERPOSE(Blocking, sleep, unsigned int, (unsigned int seconds), (seconds))
+PAX_RT_CHECK_INTERPOSE(Blocking, poll, int, (pollfd* fds, nfds_t count, int timeout), (fds, count, timeout))
+PAX_RT_CHECK_INTERPOSE(Blocking, fsync, int, (int fd), (fd))
+PAX_RT_CHECK_INTERPOSE(Blocking, fdatasync, int, (int fd), (fd))
+
+#undef PAX_RT_CHECK_INTERPOSE
+
+} // extern "C"
+
+#endif // __GLIBC__
+
+#endif // PAX_RT_CHECK_IMPLEMENTATION
+
+#endif // PAX_RT_CHECK
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace pax {
+
+// Single-writer, multi-reader publication of a small trivially copyable
+// value. Readers never block the writer and never take a lock; they just
+// retry if they raced with a write. The value is stored as relaxed atomic
+// words so there's no formal data race either
+template <class T>
+class SeqLock
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+
+	SeqLock() { store(T {}); }
+
+	auto load() const noexcept -> T;
+	auto store(const T& value) noexcept -> void;
+
+private:
+
+	static constexpr auto WORDS { (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t) };
+
+	std::atomic<std::uint32_t> seq_ {};
+	std::array<std::atomic<std::uint64_t>, WORDS> words_ {};
+};
+
+template <class T>
+auto SeqLock<T>::load() const noexcept -> T
+{
+	std::array<std::uint64_t, WORDS> words;
+
+	for (;;)
+	{
+		const auto before { seq_.load(std::memory_order_acquire) };
+
+		if (before & 1) continue;
+
+		for (std::size_t i { 0 }; i < WORDS; i++)
+		{
+			words[i] = words_[i].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (seq_.load(std::memory_order_relaxed) == before) break;
+	}
+
+	T out;
+
+	std::memcpy(static_cast<void*>(&out), words.data(), sizeof(T));
+
+	return out;
+}
+
+template <class T>
+auto SeqLock<T>::store(const T& value) noexcept -> void
+{
+	std::array<std::uint64_t, WORDS> words {};
+
+	std::memcpy(words.data(), &value, sizeof(T));
+
+	const auto seq { seq_.load(std::memory_order_relaxed) };
+
+	seq_.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (std::size_t i { 0 }; i < WORDS; i++)
+	{
+		words_[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	seq_.store(seq + 2, std::memory_order_release);
+}
+
+} // pax
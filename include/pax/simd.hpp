@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// Define PAX_SIMD_SCALAR to force the portable versions
+#if !defined(PAX_SIMD_SCALAR)
+#	if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#		include <emmintrin.h>
+#		define PAX_SIMD_SSE2
+#	elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#		include <arm_neon.h>
+#		define PAX_SIMD_NEON
+#	endif
+#endif
+
+namespace pax {
+namespace simd {
+
+// Small kernels over planar float buffers for use on the audio thread.
+// Unaligned pointers are fine; aligned ones (see PlanarBuffer) are faster
+// on older hardware. Nothing here allocates.
+
+// Largest absolute value
+inline auto peak(const float* data, std::size_t count) noexcept -> float
+{
+	std::size_t i { 0 };
+	float out { 0.0f };
+
+#if defined(PAX_SIMD_SSE2)
+	const auto abs_mask { _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)) };
+
+	auto max0 { _mm_setzero_ps() };
+	auto max1 { _mm_setzero_ps() };
+
+	for (; i + 8 <= count; i += 8)
+	{
+		max0 = _mm_max_ps(max0, _mm_and_ps(_mm_loadu_ps(data + i), abs_mask));
+		max1 = _mm_max_ps(max1, _mm_and_ps(_mm_loadu_ps(data + i + 4), abs_mask));
+	}
+
+	max0 = _mm_max_ps(max0, max1);
+	max0 = _mm_max_ps(max0, _mm_shuffle_ps(max0, max0, _MM_SHUFFLE(1, 0, 3, 2)));
+	max0 = _mm_max_ps(max0, _mm_shuffle_ps(max0, max0, _MM_SHUFFLE(2, 3, 0, 1)));
+	out = _mm_cvtss_f32(max0);
+#elif defined(PAX_SIMD_NEON)
+	auto max0 { vdupq_n_f32(0.0f) };
+	auto max1 { vdupq_n_f32(0.0f) };
+
+	for (; i + 8 <= count; i += 8)
+	{
+		max0 = vmaxq_f32(max0, vabsq_f32(vld1q_f32(data + i)));
+		max1 = vmaxq_f32(max1, vabsq_f32(vld1q_f32(data + i + 4)));
+	}
+
+	max0 = vmaxq_f32(max0, max1);
+
+	const auto pair { vpmax_f32(vget_low_f32(max0), vget_high_f32(max0)) };
+
+	out = std::max(vget_lane_f32(pair, 0), vget_lane_f32(pair, 1));
+#endif
+
+	for (; i < count; i++)
+	{
+		out = std::max(out, std::abs(data[i]));
+	}
+
+	return out;
+}
+
+inline auto sum_of_squares(const float* data, std::size_t count) noexcept -> float
+{
+	std::size_t i { 0 };
+	float out { 0.0f };
+
+#if defined(PAX_SIMD_SSE2)
+	auto sum0 { _mm_setzero_ps() };
+	auto sum1 { _mm_setzero_ps() };
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const auto a { _mm_loadu_ps(data + i) };
+		const auto b { _mm_loadu_ps(data + i + 4) };
+
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(a, a));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(b, b));
+	}
+
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_shuffle_ps(sum0, sum0, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum0 = _mm_add_ps(sum0, _mm_shuffle_ps(sum0, sum0, _MM_SHUFFLE(2, 3, 0, 1)));
+	out = _mm_cvtss_f32(sum0);
+#elif defined(PAX_SIMD_NEON)
+	auto sum0 { vdupq_n_f32(0.0f) };
+	auto sum1 { vdupq_n_f32(0.0f) };
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const auto a { vld1q_f32(data + i) };
+		const auto b { vld1q_f32(data + i + 4) };
+
+		sum0 = vmlaq_f32(sum0, a, a);
+		sum1 = vmlaq_f32(sum1, b, b);
+	}
+
+	sum0 = vaddq_f32(sum0, sum1);
+
+	const auto pair { vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0)) };
+
+	out = vget_lane_f32(pair, 0) + vget_lane_f32(pair, 1);
+#endif
+
+	for (; i < count; i++)
+	{
+		out += data[i] * data[i];
+	}
+
+	return out;
+}
+
+// dest += source * gain
+inline auto mix_add(float* dest, const float* source, std::size_t count, float gain) noexcept -> void
+{
+	std::size_t i { 0 };
+
+#if defined(PAX_SIMD_SSE2)
+	const auto g { _mm_set1_ps(gain) };
+
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(_mm_loadu_ps(source + i), g)));
+		_mm_storeu_ps(dest + i + 4, _mm_add_ps(_mm_loadu_ps(dest + i + 4), _mm_mul_ps(_mm_loadu_ps(source + i + 4), g)));
+	}
+#elif defined(PAX_SIMD_NEON)
+	for (; i + 8 <= count; i += 8)
+	{
+		vst1q_f32(dest + i, vmlaq_n_f32(vld1q_f32(dest + i), vld1q_f32(source + i), gain));
+		vst1q_f32(dest + i + 4, vmlaq_n_f32(vld1q_f32(dest + i + 4), vld1q_f32(source + i + 4), gain));
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		dest[i] += source[i] * gain;
+	}
+}
+
+// Same but the gain moves linearly from one value to the other over the
+// buffer, to change it without a click
+inline auto mix_add_ramp(float* dest, const float* source, std::size_t count, float from, float to) noexcept -> void
+{
+	if (from == to)
+	{
+		mix_add(dest, source, count, to);
+		return;
+	}
+
+	const auto step { (to - from) / float(count) };
+
+	std::size_t i { 0 };
+
+#if defined(PAX_SIMD_SSE2)
+	auto g { _mm_add_ps(_mm_set1_ps(from), _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps(step))) };
+
+	const auto g_step { _mm_set1_ps(step * 4.0f) };
+
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(_mm_loadu_ps(source + i), g)));
+
+		g = _mm_add_ps(g, g_step);
+	}
+#elif defined(PAX_SIMD_NEON)
+	const float lanes[4] { 0.0f, 1.0f, 2.0f, 3.0f };
+
+	auto g { vmlaq_n_f32(vdupq_n_f32(from), vld1q_f32(lanes), step) };
+
+	const auto g_step { vdupq_n_f32(step * 4.0f) };
+
+	for (; i + 4 <= count; i += 4)
+	{
+		vst1q_f32(dest + i, vmlaq_f32(vld1q_f32(dest + i), vld1q_f32(source + i), g));
+
+		g = vaddq_f32(g, g_step);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		dest[i] += source[i] * (from + (step * float(i)));
+	}
+}
+
+// True if no sample's absolute value is above the threshold. Stops at
+// the first chunk which isn't, so a loud signal costs almost nothing
+inline auto is_silent(const float* data, std::size_t count, float threshold) noexcept -> bool
+{
+	constexpr std::size_t CHUNK { 64 };
+
+	for (std::size_t i { 0 }; i < count; i += CHUNK)
+	{
+		if (peak(data + i, std::min(CHUNK, count - i)) > threshold) return false;
+	}
+
+	return true;
+}
+
+// Peak of a signal upsampled 4x by a polyphase FIR. coefficients holds
+// taps * 4 values, tap-major, so all four phases of a tap are adjacent
+// and get computed together in one vector. data[-(taps - 1)] to data[-1]
+// must be valid (the previous block's tail)
+inline auto peak_4x(const float* data, std::size_t count, const float* coefficients, std::size_t taps) noexcept -> float
+{
+#if defined(PAX_SIMD_SSE2)
+	const auto abs_mask { _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)) };
+
+	auto max { _mm_setzero_ps() };
+	std::size_t n { 0 };
+
+	// Four output samples at a time so the accumulators don't wait on
+	// each other
+	for (; n + 4 <= count; n += 4)
+	{
+		auto acc0 { _mm_setzero_ps() };
+		auto acc1 { _mm_setzero_ps() };
+		auto acc2 { _mm_setzero_ps() };
+		auto acc3 { _mm_setzero_ps() };
+
+		for (std::size_t t { 0 }; t < taps; t++)
+		{
+			const auto c { _mm_loadu_ps(coefficients + (t * 4)) };
+			const auto x { data + std::ptrdiff_t(n) - std::ptrdiff_t(t) };
+
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(c, _mm_set1_ps(x[0])));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(c, _mm_set1_ps(x[1])));
+			acc2 = _mm_add_ps(acc2, _mm_mul_ps(c, _mm_set1_ps(x[2])));
+			acc3 = _mm_add_ps(acc3, _mm_mul_ps(c, _mm_set1_ps(x[3])));
+		}
+
+		max = _mm_max_ps(max, _mm_max_ps(_mm_and_ps(acc0, abs_mask), _mm_and_ps(acc1, abs_mask)));
+		max = _mm_max_ps(max, _mm_max_ps(_mm_and_ps(acc2, abs_mask), _mm_and_ps(acc3, abs_mask)));
+	}
+
+	for (; n < count; n++)
+	{
+		auto acc { _mm_setzero_ps() };
+
+		for (std::size_t t { 0 }; t < taps; t++)
+		{
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(coefficients + (t * 4)), _mm_set1_ps(data[std::ptrdiff_t(n) - std::ptrdiff_t(t)])));
+		}
+
+		max = _mm_max_ps(max, _mm_and_ps(acc, abs_mask));
+	}
+
+	max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(1, 0, 3, 2)));
+	max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtss_f32(max);
+#elif defined(PAX_SIMD_NEON)
+	auto max { vdupq_n_f32(0.0f) };
+	std::size_t n { 0 };
+
+	for (; n + 4 <= count; n += 4)
+	{
+		auto acc0 { vdupq_n_f32(0.0f) };
+		auto acc1 { vdupq_n_f32(0.0f) };
+		auto acc2 { vdupq_n_f32(0.0f) };
+		auto acc3 { vdupq_n_f32(0.0f) };
+
+		for (std::size_t t { 0 }; t < taps; t++)
+		{
+			const auto c { vld1q_f32(coefficients + (t * 4)) };
+			const auto x { data + std::ptrdiff_t(n) - std::ptrdiff_t(t) };
+
+			acc0 = vmlaq_n_f32(acc0, c, x[0]);
+			acc1 = vmlaq_n_f32(acc1, c, x[1]);
+			acc2 = vmlaq_n_f32(acc2, c, x[2]);
+			acc3 = vmlaq_n_f32(acc3, c, x[3]);
+		}
+
+		max = vmaxq_f32(max, vmaxq_f32(vabsq_f32(acc0), vabsq_f32(acc1)));
+		max = vmaxq_f32(max, vmaxq_f32(vabsq_f32(acc2), vabsq_f32(acc3)));
+	}
+
+	for (; n < count; n++)
+	{
+		auto acc { vdupq_n_f32(0.0f) };
+
+		for (std::size_t t { 0 }; t < taps; t++)
+		{
+			acc = vmlaq_n_f32(acc, vld1q_f32(coefficients + (t * 4)), data[std::ptrdiff_t(n) - std::ptrdiff_t(t)]);
+		}
+
+		max = vmaxq_f32(max, vabsq_f32(acc));
+	}
+
+	const auto pair { vpmax_f32(vget_low_f32(max), vget_high_f32(max)) };
+
+	return std::max(vget_lane_f32(pair, 0), vget_lane_f32(pair, 1));
+#else
+	float out { 0.0f };
+
+	for (std::size_t n { 0 }; n < count; n++)
+	{
+		float acc[4] {};
+
+		for (std::size_t t { 0 }; t < taps; t++)
+		{
+			const auto x { data[std::ptrdiff_t(n) - std::ptrdiff_t(t)] };
+
+			for (std::size_t p { 0 }; p < 4; p++)
+			{
+				acc[p] += coefficients[(t * 4) + p] * x;
+			}
+		}
+
+		for (std::size_t p { 0 }; p < 4; p++)
+		{
+			out = std::max(out, std::abs(acc[p]));
+		}
+	}
+
+	return out;
+#endif
+}
+
+} // simd
+} // pax
@@ -1,10 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
 #include <vector>
+#include "block_adapter.hpp"
+#include "command_queue.hpp"
 #include "device.hpp"
+#include "latency.hpp"
+#include "meter.hpp"
+#include "monitor.hpp"
 #include "pa_stream.hpp"
+#include "processor.hpp"
+#include "recorder.hpp"
+#include "replay.hpp"
+#include "rt.hpp"
+#include "rt_check.hpp"
+#include "seqlock.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
 
 namespace pax {
 
@@ -23,6 +45,46 @@ public:
 			std::function<void()> starting;
 			std::function<void()> stopped;
 		} callbacks;
+
+		rt::Hygiene rt;
+
+		// Meter the input and output of every callback if set
+		std::optional<Meter::Options> metering;
+
+		// Size of the scratch arena passed in every block, as a number of
+		// Arena::planar() buffers of one block at the larger of the
+		// stream's channel counts. 0 for none
+		std::size_t scratch_buffers {};
+		std::size_t scratch_extra_bytes {};
+
+		// Track whether each callback's input and output are silent,
+		// meaning nothing louder than silence_threshold. The input is
+		// always checked while the processor is idle, since that's what
+		// wakes it
+		bool detect_silence {};
+		float silence_threshold { 1.0e-5f };
+	};
+
+	// Tuning for ALSA devices. Requesting these for a device on any other
+	// host fails
+	struct ALSASettings
+	{
+		// How many periods of frames_per_buffer the ALSA buffer holds, 0
+		// for PortAudio's default. With a fixed frames_per_buffer the
+		// suggested latency is set to match, so this is the latency
+		int periods {};
+
+		// Run the callback thread with SCHED_FIFO
+		bool realtime_scheduling {};
+
+		// Times to retry opening a busy device, -1 for PortAudio's default
+		int retries_busy { -1 };
+
+		// Open these device strings (e.g. "hw:1,0") directly instead of
+		// the requested devices, bypassing the plug layer. The requested
+		// devices are still used for channel counts and validation
+		std::string input_device;
+		std::string output_device;
 	};
 
 	struct StreamInfo
@@ -34,6 +96,19 @@ public:
 		unsigned long frames_per_buffer;
 		int SR {};
 		double latency {};
+
+		// Fixed processing block size and the latency in frames which
+		// the block adapter adds to reach it. 0 if not re-blocking. The
+		// latency can go up while the stream runs (see BlockAdapter),
+		// and get_info() always has the current value
+		unsigned long block_size {};
+		unsigned long block_latency {};
+
+		// Host specifics as applied. Cards are -1 if unknown
+		std::optional<ALSASettings> alsa {};
+		int alsa_input_card { -1 };
+		int alsa_output_card { -1 };
+		std::string jack_client_name {};
 	};
 
 	struct Request
@@ -42,32 +117,147 @@ public:
 		Device output_device;
 		unsigned long frames_per_buffer;
 		int SR {};
+
+		// If non-zero, the processor is always called with blocks of
+		// exactly this many frames. Must be a power of two
+		unsigned long block_size {};
+
+		std::optional<ALSASettings> alsa {};
+	};
+
+	enum class State
+	{
+		Closed,
+		Opening,
+		Starting,
+		Armed,
+		Running,
+		Stopping,
+		Finished,
+		Failed,
 	};
 
+	// Snapshot of the current stream which can be read from any thread,
+	// including the audio thread, without calling into PortAudio
+	struct Status
+	{
+		State state { State::Closed };
+		PaHostApiTypeId host_type { PaHostApiTypeId(-1) };
+		PaDeviceIndex input_device { paNoDevice };
+		PaDeviceIndex output_device { paNoDevice };
+		int input_channels {};
+		int output_channels {};
+		int SR {};
+		unsigned long frames_per_buffer {};
+		unsigned long block_size {};
+		unsigned long block_latency {};
+		PaTime input_latency {};
+		PaTime output_latency {};
+	};
+
+	// When audio really started after go(). output_dac is the stream time
+	// the processor's first frame reaches the output, and armed_frames is
+	// how many frames of silence were played while armed
+	struct Start
+	{
+		PaTime input_adc {};
+		PaTime output_dac {};
+		std::uint64_t armed_frames {};
+	};
+
+	// Called on whichever thread made the transition. For Finished that
+	// can be a PortAudio thread. No lock is held while listeners run, so
+	// they can call back into the stream. Anything a listener throws is
+	// swallowed, since transitions also happen during teardown
+	using StateListener = std::function<void(State from, State to)>;
 	using StreamFinishedTask = std::function<void()>;
 
 	Stream(Config && config);
+	~Stream();
 
 	auto abort() -> void;
+	auto get_block_underruns() const -> std::uint64_t;
+	auto get_callback_count() const noexcept -> std::uint64_t;
 	auto get_cpu_load() const -> double;
 	auto get_host_type() const -> PaHostApiTypeId;
+	auto get_idle_ratio() const noexcept -> double;
 	auto get_info() const -> std::optional<StreamInfo>;
 	auto get_input_channel_count() const -> int;
+	auto get_input_levels(int channel) const -> Levels;
+	auto get_last_request() const -> std::optional<Request>;
+	auto get_latency_store() -> latency::Store&;
+	auto get_monitor() -> Monitor&;
 	auto get_output_latency() const -> double;
+	auto get_output_levels(int channel) const -> Levels;
+	auto get_round_trip_latency() const -> double;
+	auto get_rt_report() const -> rt::Report;
+	auto get_scratch_stats() const -> Arena::Stats;
+	auto get_start() const -> std::optional<Start>;
 	auto get_time() const -> double;
 	auto get_SR() const -> int;
+	auto get_state() const noexcept -> State;
+	auto get_status() const noexcept -> Status;
+	auto go() -> bool;
 	auto is_active() const -> bool;
+	auto is_idle() const noexcept -> bool;
+	auto is_input_silent() const noexcept -> bool;
+	auto is_output_silent() const noexcept -> bool;
+	auto measure_latency(const latency::Options& options = {}) -> std::optional<latency::Measurement>;
+	auto prepare(Request settings, bool run_silent = true) -> void;
 	auto push_finished_task(StreamFinishedTask task) -> void;
 	auto request(Request settings) -> void;
+	auto reset_meters() -> void;
 	auto set_callback(PaStreamCallback* callback, void* user_data) -> void;
+	auto set_capture(replay::Capture* capture) -> void;
+	auto set_processor(Processor processor) -> void;
+	template <class T> auto set_processor(T* processor) -> void;
+	template <class T, class Command> auto set_processor(T* processor, CommandQueue<Command>* queue) -> void;
+	auto set_recorder(Recorder* recorder) -> void;
 	auto stop() -> void;
+	auto subscribe(StateListener listener) -> std::size_t;
+	auto unsubscribe(std::size_t id) -> void;
+	auto wake() noexcept -> void;
+
+	// Non-throwing versions for pollers and teardown
+	auto try_abort() noexcept -> portaudio::Result<>;
+	auto try_is_active() const noexcept -> portaudio::Result<bool>;
+	auto try_stop() noexcept -> portaudio::Result<>;
 
 private:
 
+	// Scratch arena size when the host's buffer size isn't fixed
+	static constexpr unsigned long SCRATCH_UNSPECIFIED_FRAMES { 4096 };
+
+	enum class Launch
+	{
+		Now,
+		Armed,
+		ArmedStopped,
+	};
+
+	auto configure_host(std::optional<PaStreamParameters>& input_params, PaStreamParameters& output_params) -> void;
+	auto latency_key() const -> std::optional<std::string>;
+	auto notify(State from, State to) noexcept -> void;
+	auto open(Request settings, Launch launch) -> void;
+	auto report_host() -> void;
+	auto publish_status() -> void;
 	auto raise_error(std::string error) -> void;
-	auto start() -> void;
+	auto set_state(State to) -> void;
+	auto stay_idle(const Block& block) noexcept -> bool;
+	auto start(Launch launch) -> void;
+	auto synchronize_callback() const -> void;
+	auto transition(State from, State to) -> bool;
 
 	auto on_finished() -> void;
+	auto process(const Block& block) -> int;
+	auto run(const Block& block) -> int;
+	auto still_armed(const PaStreamCallbackTimeInfo* time_info) -> bool;
+	auto dispatch(
+		const void* input,
+		void* output,
+		unsigned long frame_count,
+		const PaStreamCallbackTimeInfo* time_info,
+		PaStreamCallbackFlags status_flags) -> int;
 	auto callback(
 		const void* input,
 		void* output,
@@ -87,10 +277,57 @@ private:
 	Config config_;
 	std::unique_ptr<portaudio::Stream> stream_;
 	std::optional<StreamInfo> requested_info_;
+	std::optional<Request> last_request_;
+#ifdef PAX_PA_ALSA
+	PaAlsaStreamInfo alsa_input_info_ {};
+	PaAlsaStreamInfo alsa_output_info_ {};
+#endif
 	std::string last_error_;
 	std::vector<StreamFinishedTask> finished_tasks_;
+	rt::detail::Hygienist hygienist_;
 	PaStreamCallback* callback_ {};
 	void* user_data_ {};
+	Processor processor_ {};
+	std::shared_ptr<void> processor_binding_;
+	BlockAdapter block_adapter_;
+	int input_channels_ {};
+	int output_channels_ {};
+	std::uint64_t frame_position_ {};
+	std::uint64_t callback_count_ {};
+	std::atomic<std::uint64_t> callback_epoch_ {};
+	std::atomic<Recorder*> recorder_ {};
+	std::atomic<replay::Capture*> capture_ {};
+	bool armed_ {};
+	std::uint64_t armed_frames_ {};
+	std::atomic<bool> go_ {};
+	std::atomic<bool> started_ {};
+	SeqLock<Start> start_;
+	Arena scratch_;
+	Meter input_meter_;
+	Meter output_meter_;
+	bool metering_ {};
+	Monitor monitor_;
+	std::atomic<bool> idle_ {};
+	std::atomic<bool> wake_ {};
+	bool woken_ {};
+	std::atomic<bool> input_silent_ {};
+	std::atomic<bool> output_silent_ {};
+	std::atomic<std::uint64_t> idle_frames_ {};
+	std::atomic<std::uint64_t> counted_frames_ {};
+	latency::Probe latency_probe_;
+	latency::Store latency_store_;
+	std::atomic<State> state_ { State::Closed };
+	SeqLock<Status> status_;
+	// Replaced rather than modified, so notify() can take a reference
+	// and call the listeners without holding the mutex. notifying_ is
+	// which threads are doing that, for unsubscribe() to wait on
+	using Listeners = std::vector<std::pair<std::size_t, StateListener>>;
+
+	std::mutex listeners_mutex_;
+	std::condition_variable listeners_cv_;
+	std::shared_ptr<const Listeners> listeners_ { std::make_shared<Listeners>() };
+	std::vector<std::thread::id> notifying_;
+	std::size_t next_listener_id_ {};
 };
 
 inline Stream::Stream(Config && config)
@@ -98,12 +335,47 @@ inline Stream::Stream(Config && config)
 {
 }
 
+// Close the stream while the members its callbacks use are still alive
+inline Stream::~Stream()
+{
+	try_abort();
+}
+
 inline auto Stream::abort() -> void
 {
 	if (!stream_) return;
 
-	stream_->abort();
+	set_state(State::Stopping);
+
+	try
+	{
+		stream_->abort();
+	}
+	catch (const std::exception& err)
+	{
+		// Closing aborts whatever is left of it
+		stream_.reset();
+		set_state(State::Failed);
+		publish_status();
+		raise_error(err.what());
+		return;
+	}
+
 	stream_.reset();
+	set_state(State::Closed);
+	publish_status();
+}
+
+inline auto Stream::get_block_underruns() const -> std::uint64_t
+{
+	return block_adapter_.underruns();
+}
+
+// Callbacks which have completed since the stream was created. If this
+// stops going up while the stream is supposedly running, it has stalled
+inline auto Stream::get_callback_count() const noexcept -> std::uint64_t
+{
+	return callback_epoch_.load(std::memory_order_acquire) / 2;
 }
 
 inline auto Stream::get_cpu_load() const -> double
@@ -113,9 +385,24 @@ inline auto Stream::get_cpu_load() const -> double
 	return stream_->get_cpu_load();
 }
 
+// Fraction of the frames since the stream started which were skipped
+// because the processor was idle. Compare with get_cpu_load()
+inline auto Stream::get_idle_ratio() const noexcept -> double
+{
+	const auto frames { counted_frames_.load(std::memory_order_relaxed) };
+
+	if (frames < 1) return 0.0;
+
+	return double(idle_frames_.load(std::memory_order_relaxed)) / double(frames);
+}
+
 inline auto Stream::get_info() const -> std::optional<StreamInfo>
 {
-	return requested_info_;
+	auto out { requested_info_ };
+
+	if (out) out->block_latency = block_adapter_.latency();
+
+	return out;
 }
 
 inline auto Stream::get_input_channel_count() const -> int
@@ -123,11 +410,87 @@ inline auto Stream::get_input_channel_count() const -> int
 	return requested_info_ && requested_info_->input_params ? requested_info_->input_params->channelCount : 0;
 }
 
+// Levels can be polled from any thread at any rate. They read as zero
+// unless Config::metering was set when the stream started
+inline auto Stream::get_input_levels(int channel) const -> Levels
+{
+	return input_meter_.get(channel);
+}
+
+// The settings passed to the most recent request(), for reopening the
+// same stream later
+inline auto Stream::get_last_request() const -> std::optional<Request>
+{
+	return last_request_;
+}
+
+inline auto Stream::get_latency_store() -> latency::Store&
+{
+	return latency_store_;
+}
+
+// Any thread can adjust it, at any time
+inline auto Stream::get_monitor() -> Monitor&
+{
+	return monitor_;
+}
+
 inline auto Stream::get_output_latency() const -> double
 {
+	if (!stream_) return 0.0;
+
 	return stream_->info.output_latency;
 }
 
+inline auto Stream::get_output_levels(int channel) const -> Levels
+{
+	return output_meter_.get(channel);
+}
+
+inline auto Stream::reset_meters() -> void
+{
+	input_meter_.reset_max();
+	output_meter_.reset_max();
+}
+
+// Measured round trip for the current device pair if there is one,
+// otherwise what the driver claims. Use this to line recordings up with
+// playback
+inline auto Stream::get_round_trip_latency() const -> double
+{
+	if (const auto key { latency_key() })
+	{
+		if (const auto measurement { latency_store_.get(*key) })
+		{
+			if (measurement->SR == get_SR()) return measurement->seconds;
+		}
+	}
+
+	if (!stream_) return 0.0;
+
+	return stream_->info.input_latency + stream_->info.output_latency;
+}
+
+inline auto Stream::get_rt_report() const -> rt::Report
+{
+	return hygienist_.report();
+}
+
+inline auto Stream::get_start() const -> std::optional<Start>
+{
+	if (!started_.load(std::memory_order_acquire)) return std::nullopt;
+
+	return start_.load();
+}
+
+// Capacity, high water mark and overflows of the scratch arena since
+// the stream started. A high water mark above the capacity means
+// allocations failed
+inline auto Stream::get_scratch_stats() const -> Arena::Stats
+{
+	return scratch_.stats();
+}
+
 inline auto Stream::get_SR() const -> int
 {
 	return requested_info_ ? requested_info_->SR : 0;
@@ -147,11 +510,304 @@ inline auto Stream::get_time() const -> double
 	return stream_->get_time();
 }
 
+inline auto Stream::get_state() const noexcept -> State
+{
+	return state_.load(std::memory_order_acquire);
+}
+
+inline auto Stream::get_status() const noexcept -> Status
+{
+	auto out { status_.load() };
+
+	out.state = get_state();
+	out.block_latency = block_adapter_.latency();
+
+	return out;
+}
+
+// Starts the processor on a stream opened with prepare(). Takes effect
+// at the next block boundary; get_start() says exactly when once it has.
+// Returns false if the stream wasn't armed
+inline auto Stream::go() -> bool
+{
+	trace::Span span { "Stream::go", "stream" };
+
+	if (get_state() != State::Armed) return false;
+
+	go_.store(true, std::memory_order_release);
+
+	// Opened with run_silent false, so nothing has started yet
+	bool starting { false };
+
+	try
+	{
+		if (!stream_->is_active())
+		{
+			starting = true;
+			config_.callbacks.starting();
+			stream_->start();
+		}
+	}
+	catch (const std::exception& err)
+	{
+		go_.store(false, std::memory_order_relaxed);
+		set_state(State::Failed);
+		raise_error(err.what());
+		return false;
+	}
+
+	transition(State::Armed, State::Running);
+
+	if (starting) config_.callbacks.started();
+
+	return true;
+}
+
 inline auto Stream::is_active() const -> bool
 {
 	return stream_ && stream_->is_active();
 }
 
+inline auto Stream::is_idle() const noexcept -> bool
+{
+	return idle_.load(std::memory_order_relaxed);
+}
+
+// As of the last callback, if Config::detect_silence is set
+inline auto Stream::is_input_silent() const noexcept -> bool
+{
+	return input_silent_.load(std::memory_order_relaxed);
+}
+
+inline auto Stream::is_output_silent() const noexcept -> bool
+{
+	return output_silent_.load(std::memory_order_relaxed);
+}
+
+inline auto Stream::try_abort() noexcept -> portaudio::Result<>
+{
+	if (!stream_) return {};
+
+	set_state(State::Stopping);
+
+	const auto result { stream_->try_abort() };
+
+	stream_.reset();
+	set_state(State::Closed);
+	publish_status();
+
+	return result;
+}
+
+inline auto Stream::try_is_active() const noexcept -> portaudio::Result<bool>
+{
+	if (!stream_) return { paNoError, false };
+
+	return stream_->try_is_active();
+}
+
+inline auto Stream::try_stop() noexcept -> portaudio::Result<>
+{
+	if (!stream_) return {};
+
+	const auto armed { !transition(State::Running, State::Stopping) && transition(State::Armed, State::Stopping) };
+
+	// Prepared without starting, so PortAudio won't call on_finished
+	if (armed)
+	{
+		if (const auto active { stream_->try_is_active() }; active && !active.value)
+		{
+			on_finished();
+			return {};
+		}
+	}
+
+	return stream_->try_stop();
+}
+
+// Applies the request's host specifics to the parameters, or throws if
+// they don't fit the devices. ALSA's periods and retries are global in
+// PortAudio, so on ALSA they're always set, back to the defaults if
+// need be, to stop one request's settings leaking into the next
+inline auto Stream::configure_host([[maybe_unused]] std::optional<PaStreamParameters>& input_params, [[maybe_unused]] PaStreamParameters& output_params) -> void
+{
+	const auto& settings { *last_request_ };
+
+	const auto is_alsa = [](const Device& device)
+	{
+		return portaudio::Library::C::GetHostApiInfo(device.info.hostApi)->type == paALSA;
+	};
+
+	const auto alsa { is_alsa(settings.output_device) && (!settings.input_device || is_alsa(*settings.input_device)) };
+
+	if (settings.alsa && !alsa)
+	{
+		throw std::runtime_error("ALSA settings were requested for a device which isn't on the ALSA host");
+	}
+
+#ifdef PAX_PA_ALSA
+	if (!alsa) return;
+
+	if (!settings.alsa)
+	{
+		portaudio::Library::C::ALSA::SetNumPeriods(portaudio::Library::C::ALSA::DEFAULT_PERIODS);
+		portaudio::Library::C::ALSA::SetRetriesBusy(portaudio::Library::C::ALSA::DEFAULT_RETRIES_BUSY);
+		return;
+	}
+
+	// The device strings are read when the stream opens, so these have
+	// to point into the stored request
+	const auto& options { *settings.alsa };
+
+	portaudio::Library::C::ALSA::SetNumPeriods(options.periods > 0 ? options.periods : portaudio::Library::C::ALSA::DEFAULT_PERIODS);
+	portaudio::Library::C::ALSA::SetRetriesBusy(options.retries_busy >= 0 ? options.retries_busy : portaudio::Library::C::ALSA::DEFAULT_RETRIES_BUSY);
+
+	if (options.periods > 0 && settings.frames_per_buffer != paFramesPerBufferUnspecified)
+	{
+		const auto latency { double(options.periods * settings.frames_per_buffer) / settings.SR };
+
+		if (input_params) input_params->suggestedLatency = latency;
+
+		output_params.suggestedLatency = latency;
+	}
+
+	const auto use_device_string = [](PaAlsaStreamInfo& info, PaStreamParameters& params, const std::string& device)
+	{
+		if (device.empty()) return;
+
+		PaAlsa_InitializeStreamInfo(&info);
+
+		info.deviceString = device.c_str();
+		params.device = paUseHostApiSpecificDeviceSpecification;
+		params.hostApiSpecificStreamInfo = &info;
+	};
+
+	if (input_params) use_device_string(alsa_input_info_, *input_params, options.input_device);
+
+	use_device_string(alsa_output_info_, output_params, options.output_device);
+#else
+	if (settings.alsa)
+	{
+		throw std::runtime_error("ALSA settings were requested but PortAudio ALSA support is not available");
+	}
+#endif
+}
+
+inline auto Stream::latency_key() const -> std::optional<std::string>
+{
+	if (!requested_info_ || !requested_info_->input_device) return std::nullopt;
+
+	return latency::Store::key(requested_info_->input_device->identity(), requested_info_->output_device.identity());
+}
+
+// Blocks the calling thread while a test signal is played through the
+// running stream, replacing the processor's output. The output must be
+// looped back to the input (physically or in the driver's mixer). The
+// result is also remembered in the latency store for this device pair
+inline auto Stream::measure_latency(const latency::Options& options) -> std::optional<latency::Measurement>
+{
+	const auto key { latency_key() };
+
+	if (get_state() != State::Running || !key || input_channels_ < 1)
+	{
+		raise_error("Latency measurement needs a running stream with an input device");
+		return std::nullopt;
+	}
+
+	latency_probe_.configure(options);
+	latency_probe_.activate();
+
+	const auto SR { requested_info_->SR };
+	const auto signal_length { double((1 << std::clamp(options.order, 10, 20)) * std::max(options.periods, 3)) / SR };
+	const auto deadline { std::chrono::steady_clock::now() + std::chrono::duration<double>(signal_length * 2.0 + 1.0) };
+
+	while (!latency_probe_.done())
+	{
+		if (std::chrono::steady_clock::now() > deadline || get_state() != State::Running)
+		{
+			latency_probe_.deactivate();
+
+			// A callback which already saw the probe as active may still
+			// be using it
+			synchronize_callback();
+
+			raise_error("Latency measurement timed out");
+			return std::nullopt;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	auto measurement { latency_probe_.analyze(SR) };
+
+	if (!measurement)
+	{
+		raise_error("Latency measurement failed: no test signal detected on the input");
+		return std::nullopt;
+	}
+
+	measurement->reported_seconds = stream_->info.input_latency + stream_->info.output_latency;
+	latency_store_.set(*key, *measurement);
+
+	return measurement;
+}
+
+inline auto Stream::publish_status() -> void
+{
+	Status status;
+
+	if (requested_info_)
+	{
+		status.input_device = requested_info_->input_device ? requested_info_->input_device->index : paNoDevice;
+		status.output_device = requested_info_->output_device.index;
+		status.input_channels = input_channels_;
+		status.output_channels = output_channels_;
+		status.SR = requested_info_->SR;
+		status.frames_per_buffer = requested_info_->frames_per_buffer;
+		status.block_size = requested_info_->block_size;
+		status.block_latency = requested_info_->block_latency;
+	}
+
+	if (stream_)
+	{
+		status.host_type = stream_->host_type;
+		status.input_latency = stream_->info.input_latency;
+		status.output_latency = stream_->info.output_latency;
+	}
+
+	status_.store(status);
+}
+
+// Called once the stream is open, before it starts
+inline auto Stream::report_host() -> void
+{
+	requested_info_->alsa_input_card = -1;
+	requested_info_->alsa_output_card = -1;
+	requested_info_->jack_client_name.clear();
+
+	if (stream_->host_type == paALSA)
+	{
+		if (requested_info_->alsa && requested_info_->alsa->realtime_scheduling)
+		{
+			portaudio::Library::C::ALSA::EnableRealtimeScheduling(stream_->stream, true);
+		}
+
+		if (requested_info_->input_params)
+		{
+			if (const auto card { portaudio::Library::C::ALSA::GetStreamInputCard(stream_->stream) }) requested_info_->alsa_input_card = card.value;
+		}
+
+		if (const auto card { portaudio::Library::C::ALSA::GetStreamOutputCard(stream_->stream) }) requested_info_->alsa_output_card = card.value;
+	}
+
+#ifdef PAX_PA_JACK
+	if (stream_->host_type == paJACK)
+	{
+		requested_info_->jack_client_name = portaudio::Library::C::JACK::GetClientName();
+	}
+#endif
+}
+
 inline auto Stream::raise_error(std::string error) -> void
 {
 	last_error_ = error;
@@ -164,10 +820,42 @@ inline auto Stream::push_finished_task(StreamFinishedTask task) -> void
 }
 
 inline auto Stream::request(Request settings) -> void
+{
+	trace::Span span { "Stream::request", "stream" };
+
+	open(std::move(settings), Launch::Now);
+}
+
+// Does all the slow parts of request() (probing, opening and by default
+// starting the stream) but leaves the processor bypassed, so go() can
+// start it with no more delay than one block. While armed the stream
+// runs silent, or if run_silent is false it is opened but not started
+// and go() only has to start it
+inline auto Stream::prepare(Request settings, bool run_silent) -> void
+{
+	trace::Span span { "Stream::prepare", "stream" };
+
+	open(std::move(settings), run_silent ? Launch::Armed : Launch::ArmedStopped);
+}
+
+inline auto Stream::open(Request settings, Launch launch) -> void
 {
 	if (is_active()) return;
 
 	stream_.reset();
+	last_request_.emplace(settings);
+	set_state(State::Opening);
+
+	if (settings.block_size > 0 && !detail::is_power_of_two(settings.block_size))
+	{
+		std::stringstream ss;
+
+		ss << "Block size " << settings.block_size << " is not a power of two";
+
+		set_state(State::Failed);
+		raise_error(ss.str());
+		return;
+	}
 
 	try
 	{
@@ -193,6 +881,8 @@ inline auto Stream::request(Request settings) -> void
 		output_params.device = settings.output_device.index;
 		output_params.suggestedLatency = settings.output_device.info.defaultLowOutputLatency;
 
+		configure_host(input_params, output_params);
+
 		const auto input_params_ptr { input_params ? &(*input_params) : nullptr };
 		const auto output_params_ptr { &output_params };
 
@@ -230,6 +920,7 @@ inline auto Stream::request(Request settings) -> void
 
 			if (check_supported != paFormatIsSupported)
 			{
+				set_state(State::Failed);
 				raise_error(error_text);
 
 				return;
@@ -244,27 +935,88 @@ inline auto Stream::request(Request settings) -> void
 			settings.output_device,
 			settings.frames_per_buffer,
 			settings.SR,
+			{},
+			settings.block_size,
+			{},
+			settings.alsa,
 		};
 
 		requested_info_.emplace(std::move(requested_info));
 
-		start();
+		start(launch);
 	}
 	catch (const std::exception& err)
 	{
+		set_state(State::Failed);
 		raise_error(err.what());
 	}
 }
 
-inline auto Stream::start() -> void
+inline auto Stream::start(Launch launch) -> void
 {
+	trace::Span span { "Stream::start", "stream" };
+
 	try
 	{
 		if (!requested_info_) return;
 
 		const auto input_params { requested_info_->input_params ? &(*requested_info_->input_params) : nullptr };
 		const auto output_params { &requested_info_->output_params };
-		
+
+		input_channels_ = input_params ? input_params->channelCount : 0;
+		output_channels_ = output_params->channelCount;
+		frame_position_ = 0;
+		armed_ = launch != Launch::Now;
+		armed_frames_ = 0;
+		go_.store(false, std::memory_order_relaxed);
+		started_.store(false, std::memory_order_relaxed);
+
+		if (!detail::channels_match(processor_.input_channels, input_channels_) ||
+			!detail::channels_match(processor_.output_channels, output_channels_))
+		{
+			std::stringstream ss;
+
+			ss << "Processor expects " << processor_.input_channels << " input and " << processor_.output_channels
+			   << " output channels but the stream has " << input_channels_ << " and " << output_channels_;
+
+			set_state(State::Failed);
+			raise_error(ss.str());
+			return;
+		}
+
+		block_adapter_.configure(requested_info_->block_size, requested_info_->frames_per_buffer, input_channels_, output_channels_, requested_info_->SR);
+		requested_info_->block_latency = block_adapter_.latency();
+
+		if (processor_.prepare)
+		{
+			const auto frames_per_buffer { requested_info_->frames_per_buffer == paFramesPerBufferUnspecified ? 0 : requested_info_->frames_per_buffer };
+
+			processor_.prepare(processor_.object, { double(requested_info_->SR), frames_per_buffer, requested_info_->block_size, input_channels_, output_channels_ });
+		}
+
+		// With no fixed buffer size PortAudio can deliver anything, so
+		// this is only a guess and the stats will say if it's too small
+		const auto scratch_frames {
+			requested_info_->block_size > 0 ? requested_info_->block_size :
+			requested_info_->frames_per_buffer != paFramesPerBufferUnspecified ? requested_info_->frames_per_buffer :
+			SCRATCH_UNSPECIFIED_FRAMES
+		};
+
+		scratch_.reserve(detail::planar_arena_size(config_.scratch_buffers, std::size_t(std::max(input_channels_, output_channels_)), scratch_frames) + config_.scratch_extra_bytes);
+
+		monitor_.reset();
+		idle_.store(false, std::memory_order_relaxed);
+		woken_ = false;
+		idle_frames_.store(0, std::memory_order_relaxed);
+		counted_frames_.store(0, std::memory_order_relaxed);
+		metering_ = config_.metering.has_value();
+
+		if (metering_)
+		{
+			input_meter_.configure(*config_.metering, input_channels_, requested_info_->SR);
+			output_meter_.configure(*config_.metering, output_channels_, requested_info_->SR);
+		}
+
 		pax::portaudio::Stream::Config config;
 
 		config.callback = &Stream::_callback;
@@ -276,17 +1028,40 @@ inline auto Stream::start() -> void
 		config.user_data = this;
 
 		stream_.reset();
+		hygienist_.configure(config_.rt);
 		stream_ = std::make_unique<pax::portaudio::Stream>(config);
 		stream_->set_finished_callback(&Stream::_on_finished);
+		report_host();
+		publish_status();
 	}
 	catch (const std::exception& err)
 	{
+		set_state(State::Failed);
 		raise_error(err.what());
 		return;
 	}
 
+	if (launch == Launch::ArmedStopped)
+	{
+		set_state(State::Armed);
+		return;
+	}
+
+	set_state(State::Starting);
 	config_.callbacks.starting();
-	stream_->start();
+
+	try
+	{
+		stream_->start();
+	}
+	catch (const std::exception& err)
+	{
+		set_state(State::Failed);
+		raise_error(err.what());
+		return;
+	}
+
+	set_state(launch == Launch::Armed ? State::Armed : State::Running);
 	config_.callbacks.started();
 }
 
@@ -296,21 +1071,205 @@ inline auto Stream::set_callback(PaStreamCallback* callback, void* user_data) ->
 	user_data_ = user_data;
 }
 
+// Same rules as set_recorder(). Everything the callback receives from
+// PortAudio is captured, before any re-blocking
+inline auto Stream::set_capture(replay::Capture* capture) -> void
+{
+	capture_.store(capture, std::memory_order_seq_cst);
+	synchronize_callback();
+}
+
+// Like set_callback(), only call this while the stream isn't running
+inline auto Stream::set_processor(Processor processor) -> void
+{
+	processor_ = processor;
+	processor_binding_.reset();
+}
+
+template <class T>
+auto Stream::set_processor(T* processor) -> void
+{
+	set_processor(bind_processor(processor));
+}
+
+// Commands posted to the queue are delivered to processor->handle() at
+// the exact frame they're meant for, splitting blocks where necessary
+template <class T, class Command>
+auto Stream::set_processor(T* processor, CommandQueue<Command>* queue) -> void
+{
+	auto binding { std::make_shared<detail::CommandBinding<T, Command>>(processor, queue) };
+	auto bound { bind_processor(binding.get()) };
+
+	bound.input_channels = detail::input_channels_of<T>();
+	bound.output_channels = detail::output_channels_of<T>();
+
+	set_processor(bound);
+
+	processor_binding_ = std::move(binding);
+}
+
+// Can be called while the stream is running. The stream's input is
+// pushed to the recorder, which must already be started. After passing
+// nullptr (or another recorder) the old one is no longer referenced
+// and can be stopped
+inline auto Stream::set_recorder(Recorder* recorder) -> void
+{
+	recorder_.store(recorder, std::memory_order_seq_cst);
+	synchronize_callback();
+}
+
 inline auto Stream::stop() -> void
 {
 	if (!stream_) return;
 
+	const auto armed { !transition(State::Running, State::Stopping) && transition(State::Armed, State::Stopping) };
+
+	// Prepared without starting, so PortAudio won't call on_finished
+	if (armed && !stream_->is_active())
+	{
+		on_finished();
+		return;
+	}
+
 	stream_->stop();
 }
 
+inline auto Stream::subscribe(StateListener listener) -> std::size_t
+{
+	std::lock_guard lock { listeners_mutex_ };
+
+	const auto id { next_listener_id_++ };
+	auto listeners { std::make_shared<Listeners>(*listeners_) };
+
+	listeners->emplace_back(id, std::move(listener));
+	listeners_ = std::move(listeners);
+
+	return id;
+}
+
+// Once this returns the listener won't be called again, unless it's
+// called from inside a listener on this thread, in which case the
+// notification in progress finishes as usual
+inline auto Stream::unsubscribe(std::size_t id) -> void
+{
+	std::unique_lock lock { listeners_mutex_ };
+
+	auto listeners { std::make_shared<Listeners>(*listeners_) };
+
+	const auto pos { std::find_if(listeners->begin(), listeners->end(), [id](const auto& listener) { return listener.first == id; }) };
+
+	if (pos == listeners->end()) return;
+
+	listeners->erase(pos);
+	listeners_ = std::move(listeners);
+
+	const auto self { std::this_thread::get_id() };
+
+	listeners_cv_.wait(lock, [this, self]()
+	{
+		return std::all_of(notifying_.begin(), notifying_.end(), [self](std::thread::id id) { return id == self; });
+	});
+}
+
+// Any thread. An idle processor runs again from the next callback, e.g.
+// to start playback. Commands posted to a processor's queue wake it by
+// themselves when they're due
+inline auto Stream::wake() noexcept -> void
+{
+	wake_.store(true, std::memory_order_release);
+}
+
+inline auto Stream::set_state(State to) -> void
+{
+	const auto from { state_.exchange(to, std::memory_order_acq_rel) };
+
+	if (from == to) return;
+
+	notify(from, to);
+}
+
+// Waits for the callback in progress, if any, to return. Anything which
+// was unpublished from the callback before calling this is no longer in
+// use afterwards. The epoch is odd while a callback is running
+inline auto Stream::synchronize_callback() const -> void
+{
+	const auto epoch { callback_epoch_.load(std::memory_order_seq_cst) };
+
+	if ((epoch & 1) == 0) return;
+
+	while (callback_epoch_.load(std::memory_order_acquire) == epoch)
+	{
+		std::this_thread::yield();
+	}
+}
+
+inline auto Stream::notify(State from, State to) noexcept -> void
+{
+	std::shared_ptr<const Listeners> listeners;
+
+	const auto self { std::this_thread::get_id() };
+
+	try
+	{
+		std::lock_guard lock { listeners_mutex_ };
+
+		listeners = listeners_;
+		notifying_.push_back(self);
+	}
+	catch (...)
+	{
+		return;
+	}
+
+	for (const auto& [id, listener] : *listeners)
+	{
+		try
+		{
+			listener(from, to);
+		}
+		catch (...)
+		{
+		}
+	}
+
+	{
+		std::lock_guard lock { listeners_mutex_ };
+
+		notifying_.erase(std::find(notifying_.begin(), notifying_.end(), self));
+	}
+
+	listeners_cv_.notify_all();
+}
+
+// Only transitions if the stream is currently in the expected state, for
+// cases where the control thread and a PortAudio thread can race
+inline auto Stream::transition(State from, State to) -> bool
+{
+	if (!state_.compare_exchange_strong(from, to, std::memory_order_acq_rel)) return false;
+
+	notify(from, to);
+
+	return true;
+}
+
 inline auto Stream::on_finished() -> void
 {
+	trace::Span span { "on_finished", "stream" };
+
 	for (auto task : finished_tasks_)
 	{
 		task();
 	}
 
 	finished_tasks_.clear();
+
+	// Running -> Finished means the stream ended without being asked to,
+	// e.g. the device went away
+	if (!transition(State::Stopping, State::Finished) && !transition(State::Running, State::Finished))
+	{
+		transition(State::Armed, State::Finished);
+	}
+
 	config_.callbacks.stopped();
 }
 
@@ -326,7 +1285,220 @@ inline auto Stream::callback(
 	const PaStreamCallbackTimeInfo* time_info,
 	PaStreamCallbackFlags status_flags) -> int
 {
-	return callback_(input, output, frame_count, time_info, status_flags, user_data_);
+	callback_epoch_.fetch_add(1, std::memory_order_seq_cst);
+	hygienist_.on_callback();
+
+#ifdef PAX_RT_CHECK
+	rt::check::Scope rt_check_scope;
+#endif
+
+	const auto trace_begin { trace::sample_callback(callback_count_++) ? trace::now() : 0 };
+
+	// Both settled before the capture sees the callback, so a replay
+	// can bypass the processor in the same places
+	const auto armed { armed_ && still_armed(time_info) };
+	const auto woken { wake_.exchange(false, std::memory_order_acquire) };
+
+	woken_ = woken_ || woken;
+
+	if (const auto capture { capture_.load(std::memory_order_seq_cst) })
+	{
+		capture->push(input, frame_count, time_info, status_flags, (armed ? replay::RECORD_ARMED : 0u) | (woken ? replay::RECORD_WOKEN : 0u));
+	}
+
+	const auto result { dispatch(input, output, frame_count, time_info, status_flags) };
+
+	if (trace_begin > 0)
+	{
+		trace::record("callback", "audio", trace_begin, "frames", frame_count);
+	}
+
+	callback_epoch_.fetch_add(1, std::memory_order_release);
+
+	return result;
+}
+
+inline auto Stream::dispatch(
+	const void* input,
+	void* output,
+	unsigned long frame_count,
+	const PaStreamCallbackTimeInfo* time_info,
+	PaStreamCallbackFlags status_flags) -> int
+{
+	if (armed_)
+	{
+		const auto channels { static_cast<float* const*>(output) };
+
+		for (int c { 0 }; c < output_channels_; c++)
+		{
+			std::fill(channels[c], channels[c] + frame_count, 0.0f);
+		}
+
+		armed_frames_ += frame_count;
+
+		return paContinue;
+	}
+
+	Block block;
+
+	block.input = { static_cast<const float* const*>(input), input ? size_t(input_channels_) : 0 };
+	block.output = { static_cast<float* const*>(output), size_t(output_channels_) };
+	block.frame_count = frame_count;
+	block.time = { time_info->inputBufferAdcTime, time_info->currentTime, time_info->outputBufferDacTime, frame_position_ };
+	block.flags = { status_flags };
+	block.scratch = scratch_.capacity() > 0 ? &scratch_ : nullptr;
+
+	frame_position_ += frame_count;
+
+	if (const auto recorder { recorder_.load(std::memory_order_seq_cst) })
+	{
+		recorder->push(block);
+	}
+
+	if (metering_)
+	{
+		input_meter_.process(block.input.data(), block.input.size(), frame_count);
+	}
+
+	if (config_.detect_silence)
+	{
+		input_silent_.store(detail::is_silent(block.input, frame_count, config_.silence_threshold), std::memory_order_relaxed);
+	}
+
+	counted_frames_.fetch_add(frame_count, std::memory_order_relaxed);
+
+	auto result { int(paContinue) };
+
+	if (latency_probe_.active())
+	{
+		latency_probe_.process(block);
+	}
+	else
+	{
+		if (block_adapter_.enabled())
+		{
+			result = block_adapter_.process(block, [this](const Block& block) { return run(block); });
+		}
+		else
+		{
+			result = run(block);
+		}
+
+		if (result == process_idle) result = paContinue;
+
+		if (monitor_.get_position() == Monitor::Position::Post)
+		{
+			monitor_.process(block.input.data(), block.input.size(), block.output.data(), block.output.size(), frame_count);
+		}
+	}
+
+	if (metering_)
+	{
+		output_meter_.process(block.output.data(), block.output.size(), frame_count);
+	}
+
+	if (config_.detect_silence)
+	{
+		output_silent_.store(detail::is_silent(block.output, frame_count, config_.silence_threshold), std::memory_order_relaxed);
+	}
+
+	return result;
+}
+
+// Runs the processor on one block unless it's idle. With a block size
+// this is per block, so the block adapter keeps running while the
+// processor is idle: whatever it was holding plays out, and it's in step
+// when the processor wakes. Whether to stay idle is up to the last block
+inline auto Stream::run(const Block& block) -> int
+{
+	if (stay_idle(block))
+	{
+		idle_frames_.fetch_add(block.frame_count, std::memory_order_relaxed);
+
+		for (const auto channel : block.output)
+		{
+			std::fill(channel, channel + block.frame_count, 0.0f);
+		}
+
+		return process_idle;
+	}
+
+	const auto result { process(block) };
+
+	idle_.store(result == process_idle, std::memory_order_relaxed);
+
+	return result;
+}
+
+// A wake() from before the processor went idle counts too, which only
+// costs one extra call if there's still nothing to do
+inline auto Stream::stay_idle(const Block& block) noexcept -> bool
+{
+	if (!idle_.load(std::memory_order_relaxed)) return false;
+
+	if (detail::stay_idle(processor_, block, woken_, config_.silence_threshold)) return true;
+
+	woken_ = false;
+	idle_.store(false, std::memory_order_relaxed);
+
+	return false;
+}
+
+// While armed the output is silent and nothing downstream sees the
+// block. The first block after go() is the processor's frame 0
+inline auto Stream::still_armed(const PaStreamCallbackTimeInfo* time_info) -> bool
+{
+	if (!go_.load(std::memory_order_acquire)) return true;
+
+	armed_ = false;
+	start_.store({ time_info->inputBufferAdcTime, time_info->outputBufferDacTime, armed_frames_ });
+	started_.store(true, std::memory_order_release);
+
+	return false;
+}
+
+inline auto Stream::process(const Block& block) -> int
+{
+	const auto pre_monitor { monitor_.get_position() == Monitor::Position::Pre };
+
+	if (pre_monitor)
+	{
+		for (const auto channel : block.output)
+		{
+			std::fill(channel, channel + block.frame_count, 0.0f);
+		}
+
+		monitor_.process(block.input.data(), block.input.size(), block.output.data(), block.output.size(), block.frame_count);
+	}
+
+	if (processor_.process)
+	{
+		const auto result { processor_.process(processor_.object, block) };
+
+		scratch_.reset();
+
+		return result;
+	}
+
+	if (callback_)
+	{
+		PaStreamCallbackTimeInfo time_info;
+
+		time_info.inputBufferAdcTime = block.time.input_adc;
+		time_info.currentTime = block.time.current;
+		time_info.outputBufferDacTime = block.time.output_dac;
+
+		return callback_(block.input.data(), const_cast<float**>(block.output.data()), block.frame_count, &time_info, block.flags.bits, user_data_);
+	}
+
+	if (pre_monitor) return paContinue;
+
+	for (const auto channel : block.output)
+	{
+		std::fill(channel, channel + block.frame_count, 0.0f);
+	}
+
+	return paContinue;
 }
 
 inline auto Stream::_callback(
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include "stream.hpp"
+#include "system.hpp"
+
+namespace pax {
+
+// Watches a stream from the control thread and brings it back if it dies
+// (e.g. the device was unplugged and the stream finished on its own) or
+// stalls (it says it's running but callbacks have stopped arriving).
+//
+// Recovery closes the dead stream, rescans the devices and reopens with
+// the last request, on the same devices if they can be found by identity.
+// If they haven't come back after fallback_delay, the system default
+// devices are used instead. Streams which were stopped or aborted on
+// purpose are left alone.
+//
+// Nothing happens on a thread of its own; call update() regularly, e.g.
+// from a UI timer. Devices are rescanned by creating a fresh System, and
+// PortAudio only re-enumerates if nothing else is holding it initialized,
+// so don't keep another System alive alongside this if devices can come
+// and go.
+class Supervisor
+{
+public:
+
+	enum class Cause
+	{
+		Finished,
+		Stalled,
+	};
+
+	struct Recovery
+	{
+		Cause cause {};
+
+		// From detecting the problem to the stream running again
+		double seconds {};
+		int attempts {};
+		bool used_fallback {};
+		std::string input_device;
+		std::string output_device;
+	};
+
+	struct Config
+	{
+		// How long callbacks can stop arriving before it counts as a stall
+		double stall_timeout { 1.0 };
+		double retry_interval { 0.5 };
+
+		// How long to keep trying the original devices before falling back
+		// to the defaults. Negative to never fall back
+		double fallback_delay { 3.0 };
+
+		struct
+		{
+			std::function<void(Cause cause)> lost;
+			std::function<void(const Recovery& recovery)> recovered;
+		} callbacks;
+	};
+
+	Supervisor(Stream& stream, Config config);
+	~Supervisor();
+
+	Supervisor(const Supervisor&) = delete;
+	auto operator=(const Supervisor&) -> Supervisor& = delete;
+
+	auto recovering() const -> bool { return recovering_; }
+	auto update() -> void;
+
+private:
+
+	using Clock = std::chrono::steady_clock;
+
+	auto attempt() -> bool;
+	auto capture() -> void;
+	auto lose(Cause cause) -> void;
+	auto open(bool fallback) -> std::optional<Recovery>;
+	auto resolve(const std::string& identity, bool input, bool fallback) const -> std::optional<Device>;
+
+	Stream& stream_;
+	Config config_;
+	std::size_t listener_ {};
+	std::atomic<bool> died_ {};
+	std::unique_ptr<System> system_;
+
+	// What to reopen. Identities are captured while the devices are still
+	// valid, since a Device's name points into PortAudio's device list
+	std::optional<Stream::Request> request_;
+	std::optional<std::string> input_identity_;
+	std::string output_identity_;
+	bool captured_ {};
+
+	std::uint64_t last_count_ {};
+	Clock::time_point last_progress_ {};
+
+	bool recovering_ {};
+	Cause cause_ {};
+	Clock::time_point lost_at_ {};
+	Clock::time_point next_attempt_ {};
+	int attempts_ {};
+};
+
+inline Supervisor::Supervisor(Stream& stream, Config config)
+	: stream_ { stream }
+	, config_ { std::move(config) }
+{
+	// Running -> Finished only happens when the stream ends without being
+	// asked to. Called on a PortAudio thread so just note it
+	listener_ = stream_.subscribe([this](Stream::State from, Stream::State to)
+	{
+		if (from == Stream::State::Running && to == Stream::State::Finished)
+		{
+			died_.store(true, std::memory_order_release);
+		}
+	});
+}
+
+inline Supervisor::~Supervisor()
+{
+	stream_.unsubscribe(listener_);
+}
+
+// Remembers the devices of a stream that's running properly, once per
+// run
+inline auto Supervisor::capture() -> void
+{
+	const auto request { stream_.get_last_request() };
+
+	captured_ = true;
+
+	if (!request) return;
+
+	request_.emplace(*request);
+	input_identity_ = request->input_device ? std::optional { request->input_device->identity() } : std::nullopt;
+	output_identity_ = request->output_device.identity();
+}
+
+inline auto Supervisor::lose(Cause cause) -> void
+{
+	recovering_ = true;
+	cause_ = cause;
+	lost_at_ = Clock::now();
+	next_attempt_ = lost_at_;
+	attempts_ = 0;
+
+	if (config_.callbacks.lost) config_.callbacks.lost(cause);
+}
+
+inline auto Supervisor::update() -> void
+{
+	const auto now { Clock::now() };
+
+	if (recovering_)
+	{
+		if (now < next_attempt_) return;
+
+		if (!attempt())
+		{
+			next_attempt_ = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config_.retry_interval));
+		}
+
+		return;
+	}
+
+	if (died_.exchange(false, std::memory_order_acq_rel))
+	{
+		if (request_) lose(Cause::Finished);
+
+		return;
+	}
+
+	if (stream_.get_state() != Stream::State::Running)
+	{
+		captured_ = false;
+		return;
+	}
+
+	const auto count { stream_.get_callback_count() };
+
+	if (count != last_count_)
+	{
+		last_count_ = count;
+		last_progress_ = now;
+
+		// Callbacks arriving is proof the request really works
+		if (!captured_) capture();
+
+		return;
+	}
+
+	if (!request_) return;
+
+	if (now - last_progress_ > std::chrono::duration<double>(config_.stall_timeout))
+	{
+		lose(Cause::Stalled);
+	}
+}
+
+inline auto Supervisor::resolve(const std::string& identity, bool input, bool fallback) const -> std::optional<Device>
+{
+	if (fallback) return input ? system_->get_default_input_device() : system_->get_default_output_device();
+
+	return system_->get_device_by_identity(identity);
+}
+
+// The original devices can still be listed but fail to open (e.g. the
+// driver keeps a disconnected device around), so the defaults are tried
+// after them rather than instead of them
+inline auto Supervisor::open(bool fallback) -> std::optional<Recovery>
+{
+	const auto output { resolve(output_identity_, false, fallback) };
+
+	if (!output) return std::nullopt;
+
+	std::optional<Device> input;
+
+	if (input_identity_)
+	{
+		const auto device { resolve(*input_identity_, true, fallback) };
+
+		if (!device) return std::nullopt;
+
+		input.emplace(*device);
+	}
+
+	// Devices can't be reassigned, so this has to list every field. Keep
+	// it in step with Stream::Request
+	stream_.request({ input, *output, request_->frames_per_buffer, request_->SR, request_->block_size, request_->alsa });
+
+	if (stream_.get_state() != Stream::State::Running) return std::nullopt;
+
+	Recovery out;
+
+	out.used_fallback = fallback;
+	out.input_device = input ? input->identity() : std::string {};
+	out.output_device = output->identity();
+
+	return out;
+}
+
+inline auto Supervisor::attempt() -> bool
+{
+	attempts_++;
+
+	trace::Span span { "Supervisor::attempt", "supervisor", "attempt", attempts_ };
+
+	// Close whatever is left of the old stream before rescanning, the
+	// old device indices mean nothing afterwards
+	stream_.try_abort();
+
+	system_.reset();
+	system_ = std::make_unique<System>();
+
+	const auto elapsed { std::chrono::duration<double>(Clock::now() - lost_at_).count() };
+	const auto use_fallback { config_.fallback_delay >= 0.0 && elapsed >= config_.fallback_delay };
+
+	auto recovery { open(false) };
+
+	if (!recovery && use_fallback) recovery = open(true);
+	if (!recovery) return false;
+
+	recovery->cause = cause_;
+	recovery->seconds = std::chrono::duration<double>(Clock::now() - lost_at_).count();
+	recovery->attempts = attempts_;
+
+	recovering_ = false;
+	captured_ = false;
+	died_.store(false, std::memory_order_release);
+	last_count_ = stream_.get_callback_count();
+	last_progress_ = Clock::now();
+
+	if (config_.callbacks.recovered) config_.callbacks.recovered(*recovery);
+
+	return true;
+}
+
+} // pax
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <optional>
 #include <unordered_map>
 #include <vector>
 #include "device.hpp"
 #include "host.hpp"
+#include "trace.hpp"
 
 namespace pax {
 
@@ -13,6 +16,8 @@ class System
 {
 private:
 
+	const std::uint64_t trace_begin_ { trace::now() };
+
 	struct ScopedPA
 	{
 		ScopedPA() { portaudio::Library::C::Initialize(); }
@@ -46,6 +51,7 @@ public:
 	auto get_default_output_device(Host host) const -> std::optional<Device>;
 	auto get_device(PaDeviceIndex index) const -> std::optional<Device>;
 	auto get_device(const std::string& name) const -> std::optional<Device>;
+	auto get_device_by_identity(const std::string& identity) const -> std::optional<Device>;
 	auto get_host(Device device) const -> Host;
 	auto get_host(PaHostApiIndex index) const -> std::optional<Host>;
 	auto get_host(const std::string& name) const -> std::optional<Host>;
@@ -66,6 +72,8 @@ namespace detail {
 
 static inline auto enumerate_devices() -> System::Devices
 {
+	trace::Span span { "enumerate_devices", "system" };
+
 	System::Devices out;
 
 	const auto device_count { portaudio::Library::C::GetDeviceCount() };
@@ -82,6 +90,8 @@ static inline auto enumerate_devices() -> System::Devices
 
 static inline auto enumerate_hosts() -> System::Hosts
 {
+	trace::Span span { "enumerate_hosts", "system" };
+
 	System::Hosts out;
 
 	const auto host_count { portaudio::Library::C::GetHostApiCount() };
@@ -102,6 +112,8 @@ static inline auto enumerate_hosts() -> System::Hosts
 
 static inline auto enumerate_input_devices(const System::Devices& devices) -> std::vector<PaDeviceIndex>
 {
+	trace::Span span { "enumerate_input_devices", "system" };
+
 	std::vector<PaDeviceIndex> out;
 
 	for (const auto& [index, device] : devices)
@@ -117,6 +129,8 @@ static inline auto enumerate_input_devices(const System::Devices& devices) -> st
 
 static inline auto enumerate_output_devices(const System::Devices& devices) -> std::vector<PaDeviceIndex>
 {
+	trace::Span span { "enumerate_output_devices", "system" };
+
 	std::vector<PaDeviceIndex> out;
 
 	for (const auto& [index, device] : devices)
@@ -132,6 +146,8 @@ static inline auto enumerate_output_devices(const System::Devices& devices) -> s
 
 static inline auto enumerate_host_devices(const System::Devices& devices) -> System::HostDevices
 {
+	trace::Span span { "enumerate_host_devices", "system" };
+
 	System::HostDevices out;
 
 	for (const auto& [index, device] : devices)
@@ -144,6 +160,8 @@ static inline auto enumerate_host_devices(const System::Devices& devices) -> Sys
 
 static inline auto filter_host_devices(const System::Devices& devices, const std::vector<PaDeviceIndex>& filter) -> System::HostDevices
 {
+	trace::Span span { "filter_host_devices", "system" };
+
 	System::HostDevices out;
 
 	for (const auto& [index, device] : devices)
@@ -208,6 +226,7 @@ inline System::System()
 	, name_to_device_ { map_names_to_devices(devices) }
 	, name_to_host_ { map_names_to_hosts(hosts) }
 {
+	trace::record("System", "system", trace_begin_);
 }
 
 inline auto System::map_names_to_devices(const Devices& devices) -> NameToDeviceMap
@@ -277,6 +296,17 @@ inline auto System::get_device(const std::string& name) const -> std::optional<D
 	return get_device(pos->second);
 }
 
+// See Device::identity()
+inline auto System::get_device_by_identity(const std::string& identity) const -> std::optional<Device>
+{
+	for (const auto& [index, device] : devices)
+	{
+		if (device.identity() == identity) return device;
+	}
+
+	return std::nullopt;
+}
+
 inline auto System::get_host(Device device) const -> Host
 {
 	const auto out { get_host(device.info.hostApi) };
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace pax {
+namespace trace {
+
+// Timestamped spans of control-path work (device enumeration, format
+// probes, stream open/start/stop/close...) recorded into a lock-free
+// ring, for finding out which driver call is slow without attaching a
+// profiler. Off by default; when off each span costs one relaxed load.
+//
+// Names, categories and argument names must be string literals or
+// otherwise outlive the recorder.
+
+struct Event
+{
+	const char* name {};
+	const char* category {};
+	std::uint64_t begin {};
+	std::uint64_t end {};
+	std::uint32_t thread {};
+	const char* arg_name {};
+	std::int64_t arg {};
+};
+
+class Recorder
+{
+public:
+
+	static constexpr std::size_t DEFAULT_CAPACITY { 16384 };
+
+	// Capacity is rounded up to a power of two
+	Recorder(std::size_t capacity = DEFAULT_CAPACITY);
+
+	auto clear() -> void;
+	auto record(const Event& event) noexcept -> void;
+	auto snapshot() const -> std::vector<Event>;
+	auto write_chrome_trace(std::ostream& os) const -> void;
+
+private:
+
+	static constexpr std::size_t WORDS { 7 };
+
+	struct Slot
+	{
+		std::atomic<std::uint64_t> seq {};
+		std::array<std::atomic<std::uint64_t>, WORDS> words {};
+	};
+
+	std::size_t mask_;
+	std::unique_ptr<Slot[]> slots_;
+	std::atomic<std::uint64_t> head_ {};
+};
+
+namespace detail {
+
+inline std::atomic<bool> enabled {};
+inline std::atomic<std::uint32_t> callback_sample_interval {};
+inline std::atomic<std::uint32_t> next_thread_id {};
+
+static inline auto round_up_pow2(std::size_t value) -> std::size_t
+{
+	std::size_t out { 1 };
+
+	while (out < value) out <<= 1;
+
+	return out;
+}
+
+static inline auto write_json_string(std::ostream& os, const char* str) -> void
+{
+	os << '"';
+
+	for (auto c { str }; c && *c; c++)
+	{
+		if (*c == '"' || *c == '\\') os << '\\';
+		if (static_cast<unsigned char>(*c) < 0x20) continue;
+
+		os << *c;
+	}
+
+	os << '"';
+}
+
+// Microseconds with nanosecond precision, without touching the stream's
+// formatting flags
+static inline auto write_us(std::ostream& os, std::uint64_t ns) -> void
+{
+	const auto fraction { ns % 1000 };
+
+	os << ns / 1000 << '.' << char('0' + (fraction / 100)) << char('0' + ((fraction / 10) % 10)) << char('0' + (fraction % 10));
+}
+
+} // detail
+
+// Nanoseconds on the steady clock
+inline auto now() noexcept -> std::uint64_t
+{
+	return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+inline auto thread_id() noexcept -> std::uint32_t
+{
+	static thread_local const auto id { detail::next_thread_id.fetch_add(1, std::memory_order_relaxed) + 1 };
+
+	return id;
+}
+
+inline auto global() -> Recorder&
+{
+	static Recorder recorder;
+
+	return recorder;
+}
+
+inline auto enabled() noexcept -> bool
+{
+	return detail::enabled.load(std::memory_order_relaxed);
+}
+
+inline auto enable(bool on) -> void
+{
+	// Make sure the ring exists before anything (e.g. the audio thread)
+	// tries to record into it
+	if (on) global();
+
+	detail::enabled.store(on, std::memory_order_relaxed);
+}
+
+// Record one in every N audio callbacks as a span. 0 turns it off
+inline auto set_callback_sample_interval(std::uint32_t interval) -> void
+{
+	detail::callback_sample_interval.store(interval, std::memory_order_relaxed);
+}
+
+// Called once per callback from the audio thread
+inline auto sample_callback(std::uint64_t callback_index) noexcept -> bool
+{
+	if (!enabled()) return false;
+
+	const auto interval { detail::callback_sample_interval.load(std::memory_order_relaxed) };
+
+	return interval > 0 && callback_index % interval == 0;
+}
+
+inline auto record(const char* name, const char* category, std::uint64_t begin, const char* arg_name = nullptr, std::int64_t arg = 0) noexcept -> void
+{
+	if (!enabled()) return;
+
+	global().record({ name, category, begin, now(), thread_id(), arg_name, arg });
+}
+
+class Span
+{
+public:
+
+	Span(const char* name, const char* category = "pax", const char* arg_name = nullptr, std::int64_t arg = 0) noexcept
+		: name_ { name }
+		, category_ { category }
+		, arg_name_ { arg_name }
+		, arg_ { arg }
+		, begin_ { enabled() ? now() : 0 }
+	{
+	}
+
+	~Span()
+	{
+		if (begin_ > 0) record(name_, category_, begin_, arg_name_, arg_);
+	}
+
+	Span(const Span&) = delete;
+	auto operator=(const Span&) -> Span& = delete;
+
+private:
+
+	const char* name_;
+	const char* category_;
+	const char* arg_name_;
+	std::int64_t arg_;
+	std::uint64_t begin_;
+};
+
+inline Recorder::Recorder(std::size_t capacity)
+	: mask_ { detail::round_up_pow2(std::max(capacity, std::size_t(2))) - 1 }
+	, slots_ { std::make_unique<Slot[]>(mask_ + 1) }
+{
+}
+
+inline auto Recorder::clear() -> void
+{
+	for (std::size_t i { 0 }; i <= mask_; i++)
+	{
+		slots_[i].seq.store(0, std::memory_order_relaxed);
+	}
+}
+
+// Overwrites the oldest event once the ring is full. Each slot's seq is
+// odd while it's being written and 2 * (index + 1) once it's complete,
+// so readers can detect torn slots and order events by index
+inline auto Recorder::record(const Event& event) noexcept -> void
+{
+	const auto index { head_.fetch_add(1, std::memory_order_relaxed) };
+
+	auto& slot { slots_[index & mask_] };
+
+	slot.seq.store((index * 2) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.words[0].store(reinterpret_cast<std::uintptr_t>(event.name), std::memory_order_relaxed);
+	slot.words[1].store(reinterpret_cast<std::uintptr_t>(event.category), std::memory_order_relaxed);
+	slot.words[2].store(event.begin, std::memory_order_relaxed);
+	slot.words[3].store(event.end, std::memory_order_relaxed);
+	slot.words[4].store(event.thread, std::memory_order_relaxed);
+	slot.words[5].store(reinterpret_cast<std::uintptr_t>(event.arg_name), std::memory_order_relaxed);
+	slot.words[6].store(std::uint64_t(event.arg), std::memory_order_relaxed);
+
+	slot.seq.store((index + 1) * 2, std::memory_order_release);
+}
+
+inline auto Recorder::snapshot() const -> std::vector<Event>
+{
+	std::vector<std::pair<std::uint64_t, Event>> events;
+
+	for (std::size_t i { 0 }; i <= mask_; i++)
+	{
+		const auto& slot { slots_[i] };
+		const auto before { slot.seq.load(std::memory_order_acquire) };
+
+		if (before == 0 || before & 1) continue;
+
+		Event event;
+
+		event.name = reinterpret_cast<const char*>(slot.words[0].load(std::memory_order_relaxed));
+		event.category = reinterpret_cast<const char*>(slot.words[1].load(std::memory_order_relaxed));
+		event.begin = slot.words[2].load(std::memory_order_relaxed);
+		event.end = slot.words[3].load(std::memory_order_relaxed);
+		event.thread = std::uint32_t(slot.words[4].load(std::memory_order_relaxed));
+		event.arg_name = reinterpret_cast<const char*>(slot.words[5].load(std::memory_order_relaxed));
+		event.arg = std::int64_t(slot.words[6].load(std::memory_order_relaxed));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (slot.seq.load(std::memory_order_relaxed) != before) continue;
+
+		events.emplace_back(before, event);
+	}
+
+	std::sort(events.begin(), events.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	std::vector<Event> out;
+
+	out.reserve(events.size());
+
+	for (const auto& [seq, event] : events)
+	{
+		out.push_back(event);
+	}
+
+	return out;
+}
+
+// Chrome trace event format, which also loads in Perfetto
+inline auto Recorder::write_chrome_trace(std::ostream& os) const -> void
+{
+	const auto events { snapshot() };
+
+	os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	auto first { true };
+
+	for (const auto& event : events)
+	{
+		if (!first) os << ",";
+
+		first = false;
+
+		os << "\n{\"name\":";
+		detail::write_json_string(os, event.name);
+		os << ",\"cat\":";
+		detail::write_json_string(os, event.category);
+		os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":";
+		detail::write_us(os, event.begin);
+		os << ",\"dur\":";
+		detail::write_us(os, event.end - event.begin);
+
+		if (event.arg_name)
+		{
+			os << ",\"args\":{";
+			detail::write_json_string(os, event.arg_name);
+			os << ":" << event.arg << "}";
+		}
+
+		os << "}";
+	}
+
+	os << "\n]}\n";
+}
+
+} // trace
+} // pax